@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""
+scan for mv telemetry advertising (see adv_telemetry_data in src/bt.c) and decode it
+
+the record is manufacturer data in a non-connectable extended advertising set, little endian:
+
+    offset size field
+    0      2    company code, 0x0059 during development (COMPANY_ID_CODE)
+    2      1    version (TELEMETRY_VERSION)
+    3      1    state, 1 if power output permitted
+    4      2    seq, increments every update, wraps
+    6      4    freq_mhz, fundamental in millihertz
+    10     2    vrms_cv, fundamental magnitude in centivolts rms
+    12     2    thd_cpct, THD in hundredths of a percent
+    14     2    temp_cc, die temperature in hundredths of a degree C, signed
+
+keep this table and RECORD below in step with src/bt.c, and bump the version on both sides on
+any layout change.
+
+usage:
+    python3 telemetry_scan.py --selftest   check decoding against a packed record, no radio
+    python3 telemetry_scan.py [-t SECONDS] scan with the host adapter (needs bleak, and a
+                                             controller that reports extended advertising)
+
+periodic advertising carries the same record but needs a sync, which bleak can't do; the
+extended advertising set is enough to collect from many inverters.
+"""
+
+import argparse
+import asyncio
+import struct
+import sys
+
+COMPANY_ID_CODE = 0x0059
+TELEMETRY_VERSION = 1
+RECORD = struct.Struct("<BBHIHHh")  # after the company code, which the scanner strips
+FIELDS = ("version", "state", "seq", "freq_mhz", "vrms_cv", "thd_cpct", "temp_cc")
+
+
+def decode(payload):
+    """manufacturer data payload (company code removed) to a dict, ValueError if not ours"""
+    if len(payload) != RECORD.size:
+        # legacy advertising from the same device carries a 2 byte counter under the same code
+        raise ValueError("length %d, telemetry record is %d" % (len(payload), RECORD.size))
+    rec = dict(zip(FIELDS, RECORD.unpack(payload)))
+    if rec["version"] != TELEMETRY_VERSION:
+        raise ValueError("unknown telemetry version %d" % rec["version"])
+    return {
+        "state": rec["state"],
+        "seq": rec["seq"],
+        "freq_hz": rec["freq_mhz"]/1000.,
+        "vrms": rec["vrms_cv"]/100.,
+        "thd_pct": rec["thd_cpct"]/100.,
+        "temp_c": rec["temp_cc"]/100.,
+    }
+
+
+def selftest():
+    # the record as src/bt.c packs it, company code first
+    raw = struct.pack("<HBBHIHHh", COMPANY_ID_CODE, TELEMETRY_VERSION, 1, 0xfffe, 3000, 1203, 157, -512)
+    assert len(raw) == 16, "record is 16 bytes on air"
+    rec = decode(raw[2:])
+    assert rec == {"state": 1, "seq": 0xfffe, "freq_hz": 3., "vrms": 12.03, "thd_pct": 1.57,
+                   "temp_c": -5.12}, rec
+    for bad in (raw[2:6], raw[2:] + b"\0", bytes([2]) + raw[3:]):
+        try:
+            decode(bad)
+        except ValueError:
+            continue
+        raise AssertionError("accepted %r" % bad)
+    print("telemetry record layout ok")
+
+
+async def scan(seconds):
+    from bleak import BleakScanner
+
+    def seen(device, adv):
+        payload = adv.manufacturer_data.get(COMPANY_ID_CODE)
+        if payload is None:
+            return
+        try:
+            rec = decode(payload)
+        except ValueError:
+            return
+        print("%s rssi %d state %d seq %5d %.3f Hz %.2f Vrms THD %.2f%% %.2f C" % (
+            device.address, adv.rssi, rec["state"], rec["seq"], rec["freq_hz"], rec["vrms"],
+            rec["thd_pct"], rec["temp_c"]))
+
+    async with BleakScanner(detection_callback=seen):
+        await asyncio.sleep(seconds)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    parser.add_argument("--selftest", action="store_true", help="check record decoding only")
+    parser.add_argument("-t", "--time", type=float, default=30., help="seconds to scan")
+    args = parser.parse_args()
+    if args.selftest:
+        selftest()
+        return 0
+    asyncio.run(scan(args.time))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
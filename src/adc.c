@@ -43,25 +43,55 @@ static const struct adc_dt_spec adc_channels[] = {
 };
 
 
-#define BLOCK_SIZE 4096
-#define SAMPLE_RATE 15640.4f // constant is sampling rate, determined by experimental calibration
-#define VOLTAGE_DIVIDER_SF 0.241f // scale factor 241 is 2*820k/6.8k, *1e-3 (mV to V)
-
-uint16_t raw_data[BLOCK_SIZE*2] = {0};
-float32_t sample_data[BLOCK_SIZE] = {0.f};
-float32_t data_detrend[BLOCK_SIZE] = {0.f};
-float32_t fftout[BLOCK_SIZE/2+2]; // output of real FFT
-float32_t ps[BLOCK_SIZE]; // power spectrum, in V^2 for each bin (*not* distribution in V^2/Hz)
-float32_t block_window[BLOCK_SIZE]; // window, needs to be computed only once
-float32_t window_sum, window_sumsq; // window normalizations
+uint16_t raw_data[RAW_SIZE] = {0}; // scans of SCAN_CHANNELS, signal first
+#if VDD_SAMPLING == VDD_BLOCK
+uint16_t vdd_raw[VDD_SAMPLES] = {0}; // separate short sequence each block
+static float32_t measured_rate = SAMPLE_RATE; // free-running single channel rate has no calibration
+#endif
+int32_t sample_mv[BLOCK_SIZE] = {0}; // signal less half VDD, mV, at adc_sample_rate()
+float32_t sample_data[FFT_SIZE] = {0.f}; // decimated, V, at adc_sample_rate()/DECIMATION
+float32_t data_detrend[FFT_SIZE] = {0.f};
+float32_t fftout[FFT_SIZE]; // output of real FFT, packed as DC, nyquist, then re/im pairs
+float32_t ps[FFT_SIZE/2]; // power spectrum, in V^2 for each bin (*not* distribution in V^2/Hz)
+float32_t block_window[FFT_SIZE]; // window, needs to be computed only once
+#if SAMPLE_CLOCK == SAMPLE_CLOCK_COHERENT
+float32_t coherent_window[FFT_SIZE]; // shorter window once blocks are coherent, no leakage to hide
+#endif
+static const float32_t *active_window = block_window;
+float32_t window_sum, window_sumsq; // window normalizations, for active_window
 static arm_rfft_fast_instance_f32 arm_rfft_S; // needs to be computed only once
-
+static struct mv_spectrum_t spectrum;
+
+static struct perf_counter perf_acq = PERF_GAUGE_INIT("acq_us"); // wall time, cpu sleeps during acquisition
+static struct perf_counter perf_rate = PERF_GAUGE_INIT("sample_rate_sps");
+static struct perf_counter perf_convert = PERF_TIME_INIT("convert");
+static struct perf_counter perf_decimate = PERF_TIME_INIT("decimate");
+static struct perf_counter perf_fft = PERF_TIME_INIT("fft");
+static struct perf_counter perf_metrics = PERF_TIME_INIT("metrics");
+static struct perf_counter perf_calc = PERF_TIME_INIT("calc");
+static struct perf_counter perf_fault = PERF_TIME_INIT("fault_record"); // ring cost per block
+
+// die temperature is optional, e.g. not present on the native_sim plant simulator
+#if DT_NODE_HAS_STATUS(DT_ALIAS(die_temp0), okay)
 static const struct device *const die_temp_sensor = DEVICE_DT_GET(DT_ALIAS(die_temp0));
+#else
+static const struct device *const die_temp_sensor = NULL;
+#endif
 static float64_t die_temperature(const struct device *dev);
+static void window_select(const float32_t *window);
+static uint16_t vdd_raw_avg();
 
 
 
 void adc_init() {
+	perf_register(&perf_acq);
+	perf_register(&perf_rate);
+	perf_register(&perf_convert);
+	perf_register(&perf_decimate);
+	perf_register(&perf_fft);
+	perf_register(&perf_metrics);
+	perf_register(&perf_calc);
+	perf_register(&perf_fault);
 
 	/* Configure channels individually prior to sampling. */
 	for (size_t chan_i= 0U; chan_i< ARRAY_SIZE(adc_channels); chan_i++) {
@@ -77,28 +107,95 @@ void adc_init() {
 	}
 	
 	// fft initialization
-	arm_status status = arm_rfft_fast_init_f32(&arm_rfft_S, BLOCK_SIZE);
+	arm_status status = arm_rfft_fast_init_f32(&arm_rfft_S, FFT_SIZE);
 	if (status != ARM_MATH_SUCCESS) {
 		LOG_ERR("arm_rfft_fast_init failure");
 		// XXX fail better
 	}
-	arm_hft95_f32(block_window, BLOCK_SIZE); // window function, good to about 0.05% amplitude, ~4 bins wide
-	//	arm_accumulate_f32(block_window, BLOCK_SIZE, &window_sum);
-	window_sum = window_sumsq = 0.f;
-	for (size_t i=0; i< BLOCK_SIZE; i++) {
-		window_sum += block_window[i];
-		window_sumsq += SQR(block_window[i]);
+	arm_hft95_f32(block_window, FFT_SIZE); // window function, good to about 0.05% amplitude, ~4 bins wide
+#if SAMPLE_CLOCK == SAMPLE_CLOCK_COHERENT
+	arm_hanning_f32(coherent_window, FFT_SIZE); // ~2 bins wide
+#endif
+	window_select(block_window);
+	decimate_init();
+#if SAMPLE_TIMER
+	if (sampler_init(adc_channels, SCAN_CHANNELS) < 0) { // signal channel first, VDD only if interleaved
+		LOG_ERR("Sample clock init failed");
+		// XXX fail better
 	}
+#endif
+
+	// scale of one raw count in mV per channel, for exported fault recordings
+	int32_t full_scale_mv[ARRAY_SIZE(adc_channels)];
+	for (size_t chan_i = 0U; chan_i < ARRAY_SIZE(adc_channels); chan_i++) {
+		full_scale_mv[chan_i] = BIT(adc_channels[chan_i].resolution);
+		(void)adc_raw_to_millivolts_dt(&adc_channels[chan_i], &full_scale_mv[chan_i]);
+	}
+	fault_init((float32_t) full_scale_mv[0]/BIT(adc_channels[0].resolution),
+		(float32_t) full_scale_mv[1]/BIT(adc_channels[1].resolution));
 	
 	// initialize raw data to something nonzero by doing a read
 	adc_measure();
 
-	if (!device_is_ready(die_temp_sensor)) {
+	if (die_temp_sensor && !device_is_ready(die_temp_sensor)) {
 		LOG_ERR("sensor: device %s not ready", die_temp_sensor->name);
 		return 0;
 	}
 }
 
+static void window_select(const float32_t *window) {
+	active_window = window;
+	//	arm_accumulate_f32(window, FFT_SIZE, &window_sum);
+	window_sum = window_sumsq = 0.f;
+	for (size_t i=0; i< FFT_SIZE; i++) {
+		window_sum += window[i];
+		window_sumsq += SQR(window[i]);
+	}
+	spectral_init(window_sum, window_sumsq);
+}
+
+float32_t adc_sample_rate() {
+#if SAMPLE_TIMER
+	return sampler_rate();
+#elif VDD_SAMPLING == VDD_BLOCK
+	return measured_rate;
+#else
+	return SAMPLE_RATE;
+#endif
+}
+
+#if VDD_SAMPLING == VDD_BLOCK
+/* supply channel on its own, a few conversions between signal blocks */
+static int vdd_measure() {
+	struct adc_sequence sequence = {
+		.buffer = &vdd_raw[0],
+		.buffer_size = sizeof(vdd_raw),
+	};
+	struct adc_sequence_options opts = {
+		.extra_samplings = VDD_SAMPLES-1U,
+	};
+	(void)adc_sequence_init_dt(&adc_channels[1], &sequence);
+	sequence.options = &opts;
+	return adc_read(adc_channels[1].dev, &sequence);
+}
+#endif
+
+/* supply channel in raw counts, averaged over the block */
+static uint16_t vdd_raw_avg() {
+	uint32_t sum = 0U;
+#if VDD_SAMPLING == VDD_BLOCK
+	for (size_t i = 0; i < VDD_SAMPLES; i++) {
+		sum += vdd_raw[i];
+	}
+	return (uint16_t) (sum/VDD_SAMPLES);
+#else
+	for (size_t i = 0; i < BLOCK_SIZE; i++) {
+		sum += raw_data[2*i+1];
+	}
+	return (uint16_t) (sum/BLOCK_SIZE);
+#endif
+}
+
 void adc_measure() {
 	struct adc_sequence sequence = {
 		.buffer = &raw_data[0],
@@ -108,32 +205,56 @@ void adc_measure() {
 	struct adc_sequence_options opts = {
 		.extra_samplings = BLOCK_SIZE-1U,
 	};
+		uint32_t start_cycles = k_cycle_get_32();
 
-
-		// start_time = timing_counter_get(); // cpu time not wall time
-
+#if SAMPLE_TIMER
+		// scans on the hardware sample clock, same layout as adc_read below
+		int err = sampler_read(&raw_data[0], BLOCK_SIZE);
+		if (err < 0) {
+			LOG_ERR("Could not read (%d)", err);
+			return; // XXX error handling
+		}
+#else
 		// first, configure sequence using channel 0. channel number doesn't matter
 		// sequence.channels will be incorrect, we will fix after
 		(void)adc_sequence_init_dt(&adc_channels[0], &sequence);
+#if VDD_SAMPLING == VDD_BLOCK
+		sequence.channels = BIT(0); // signal only, VDD is read separately below
+#else
 		sequence.channels = BIT(0) | BIT(7); // we have channel 7 config also
+#endif
 		sequence.options = &opts;
 		int err = adc_read(adc_channels[0].dev, &sequence); // I think what device is linked doesn't depend on the channel
 		if (err < 0) {
 			LOG_ERR("Could not read (%d)", err);
 			return; // XXX error handling
 		} 
+#endif
 		// else {
 		// 	for (size_t sample_i = 0; sample_i < BLOCK_SIZE; sample_i++) {
 		// 		printk("%" PRId32 "\t%" PRId32 "\n", (int32_t) raw_data[2*sample_i+ 0], (int32_t) raw_data[2*sample_i+ 1]);
 		// 	}
 		// }
 
+		uint32_t acq_us = k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+		perf_set(&perf_acq, acq_us);
+		if (acq_us > 0U) {
+			perf_set(&perf_rate, (uint32_t) (BLOCK_SIZE*1000000ULL/acq_us));
+		}
 
-		// end_time = timing_counter_get();
-		// total_cycles = timing_cycles_get(&start_time, &end_time);
-		// total_ns = timing_cycles_to_ns(total_cycles); // not wall time
-		// printk("done with reading, datarate %.2f ksps\n", BLOCK_SIZE/(1.e-6*total_ns)); 
-
+#if VDD_SAMPLING == VDD_BLOCK
+#if !SAMPLE_TIMER
+		// includes driver start-up, so low by about one sample in a block
+		if (acq_us > 0U) {
+			measured_rate = BLOCK_SIZE*1.e6f/acq_us;
+		}
+#endif
+		err = vdd_measure();
+		if (err < 0) {
+			LOG_ERR("Could not read VDD (%d)", err);
+			return; // XXX error handling
+		}
+#endif
 }
 
 void adc_calc() {
@@ -152,114 +273,112 @@ void adc_calc() {
 
 		int32_t v0_mv, vdd_mv;
 
-    // start_time = timing_counter_get(); // cpu time not wall time
-
+		uint64_t calc_start = perf_begin();
+		uint64_t t = calc_start;
 
 		// let api scale to mV using devicetree
+#if VDD_SAMPLING == VDD_BLOCK
+		// supply barely moves within a block, so one averaged value serves every sample
+		vdd_mv = vdd_raw_avg();
+		if (adc_raw_to_millivolts_dt(&adc_channels[1], &vdd_mv) < 0) {
+			LOG_ERR(" (value in mV not available)");
+		}
+#endif
 		for (size_t i = 0; i < BLOCK_SIZE; i++) {
-			v0_mv = raw_data[2*i+0]; 
+			v0_mv = raw_data[SCAN_CHANNELS*i+0]; 
 			int err = adc_raw_to_millivolts_dt(&adc_channels[0],
 									&v0_mv);
 			if (err < 0) {
 				LOG_ERR(" (value in mV not available)");
 			}
+#if VDD_SAMPLING == VDD_INTERLEAVED
 			vdd_mv = raw_data[2*i+1]; 
 			err = adc_raw_to_millivolts_dt(&adc_channels[1],
 						&vdd_mv);
 			if (err < 0) {
 				LOG_ERR(" (value in mV not available)");
 			}
-			// then offset and scale to volts based on voltage dividers
-			sample_data[i] = VOLTAGE_DIVIDER_SF*(v0_mv - vdd_mv/2); 
+#endif
+			// then offset, scaled to volts based on voltage dividers by the decimator
+			sample_mv[i] = v0_mv - vdd_mv/2; 
 		}
+		perf_end(&perf_convert, t);
+		t = perf_begin();
+		decimate_block(sample_mv, sample_data, VOLTAGE_DIVIDER_SF);
+		perf_end(&perf_decimate, t);
 
 		// stats calculations on block
 
 
 		// // manual mean and sd
 		// float32_t tmpsum = 0.f, tmpsumsq = 0.f;
-		// for (int32_t i = 0; i < BLOCK_SIZE; i++) {
+		// for (int32_t i = 0; i < FFT_SIZE; i++) {
 		//   tmpsum += sample_data[i];
 		//   tmpsumsq += SQR(sample_data[i]);
 		// }
-		// printk("Mean (sd) %.6f (%.2f) V\n", tmpsum/BLOCK_SIZE, sqrt((tmpsumsq-SQR(tmpsum)/BLOCK_SIZE)/BLOCK_SIZE));
+		// printk("Mean (sd) %.6f (%.2f) V\n", tmpsum/FFT_SIZE, sqrt((tmpsumsq-SQR(tmpsum)/FFT_SIZE)/FFT_SIZE));
 
 		// now stats and fourier w dsp library
 		arm_status status = ARM_MATH_SUCCESS;
 		float32_t maxValue, meanValue;
 		uint32_t maxIndex;
 
-		float32_t binWidth = (SAMPLE_RATE/BLOCK_SIZE); 
-		arm_mean_f32(sample_data, BLOCK_SIZE, &meanValue);
-		arm_offset_f32(sample_data, -meanValue, data_detrend, BLOCK_SIZE);
-		arm_mult_f32(data_detrend, block_window, data_detrend, BLOCK_SIZE);
+		float32_t binWidth = (adc_sample_rate()/BLOCK_SIZE); 
+#if SAMPLE_CLOCK == SAMPLE_CLOCK_COHERENT
+		const float32_t *window = sampler_coherent() ? coherent_window : block_window;
+		if (window != active_window) {
+			window_select(window);
+		}
+#endif
+		t = perf_begin();
+		arm_mean_f32(sample_data, FFT_SIZE, &meanValue);
+		arm_offset_f32(sample_data, -meanValue, data_detrend, FFT_SIZE);
+		arm_mult_f32(data_detrend, active_window, data_detrend, FFT_SIZE);
 		arm_rfft_fast_f32(&arm_rfft_S, data_detrend, fftout, 0);
 		// for (size_t i = 0; i < 35; i++) {
 		// 	printk("%5.2f\t%10.2f\t%10.2f\n", binWidth*i, fftout[2*i], fftout[2*i+1]);
 		// }
-		ps[0] = 0.f; // zero out DC from power spectrum (also f_nyquist is in here too)
-		arm_cmplx_mag_squared_f32(&fftout[1], &ps[1], BLOCK_SIZE/2-1);
-		arm_max_f32(ps, BLOCK_SIZE, &maxValue, &maxIndex);
+		ps[0] = 0.f; // zero out DC from power spectrum (nyquist is packed in fftout[1], not used)
+		arm_cmplx_mag_squared_f32(&fftout[2], &ps[1], FFT_SIZE/2-1);
+		arm_max_f32(ps, FFT_SIZE/2, &maxValue, &maxIndex);
+		perf_end(&perf_fft, t);
 		if (maxIndex < 5) {
 			LOG_INF("Max power index %" PRId32 " < 5, interpret with care", maxIndex);
 		}
-		float32_t tonePower = ps[maxIndex]; 
-		float32_t harmonicPower = 0.f;
-		size_t k = 0U; // will end at number harmonics plus one
-		for (k = 2; k < 51; k++ ) { // 50 harmonics or whatever is inside our bandwidth
-			if (k*maxIndex >= BLOCK_SIZE/2) {
-				break;
-			}
-			harmonicPower += ps[k*maxIndex];
+		t = perf_begin();
+		if (spectral_calc(fftout, ps, maxIndex, binWidth, &spectrum) < 0) {
+			LOG_WRN("No tone found in spectrum");
 		}
-
-		float64_t noisePower = 0.f;
-		int32_t noiseBins = 0U;
+		perf_end(&perf_metrics, t);
 //		printk("[\n");
-		for (size_t i = 0; i < BLOCK_SIZE/2; i++) {
-			size_t ii = i % maxIndex;
-			if (ii == maxIndex-2 || ii == maxIndex - 1 || ii == 0 || ii == 1 || ii == 2) {
-				; // skip bins counted for tone or harmonics, or a couple bins either side
-			} else {
-				noisePower += ps[i];
-				noiseBins++;
-			}
+//		for (size_t i = 0; i < FFT_SIZE/2; i++) {
 //			printk("[%.3f,%.6g],\n", binWidth*i, (2*ps[i]/SQR(window_sum))); // power spectrum, voltage scaling
 //			printk("[%.3f,%.6g],\n", binWidth*i, (2*ps[i]/(binWidth*window_sumsq))); // power spectral distribution, voltage/rtHz scaling
-
-		}
+//		}
 //		printk("]\n");
-		harmonicPower -= (k-2)*noisePower/noiseBins; // subtract white noise background from harmonic distortion measurement
-		if (harmonicPower < 0.f) {
-			harmonicPower = 0.f; // if harmonic distortion outweighed by noise, display 0.
-		}
 		sysdata[0] = meanValue;
-		sysdata[1] = binWidth*maxIndex;
-		sysdata[2] = sqrt(2*tonePower/SQR(window_sum));
-		sysdata[3] = atan2(fftout[2*maxIndex+1], fftout[2*maxIndex]);
-		sysdata[4] = 100.f*sqrt(harmonicPower/tonePower);  
-		sysdata[5] = sqrt(2.f*noisePower/(binWidth*noiseBins*window_sumsq));
+		sysdata[1] = spectrum.fundamental_hz;
+		sysdata[2] = spectrum.magnitude[0];
+		sysdata[3] = spectrum.phase[0];
+		sysdata[4] = spectrum.thd;
+		sysdata[5] = spectrum.noise_density;
 		sysdata[6] = die_temperature(die_temp_sensor);
-		LOG_INF("DC %.2f Tone: %.2f Hz mag %.2f Vrms phase %.3f rad THD %.2f%% rms noise %.2f V/rtHz %.2f C", 
-			sysdata[0], sysdata[1], sysdata[2], sysdata[3], sysdata[4], sysdata[5], sysdata[6]);
-		// end_time = timing_counter_get();
-		// total_cycles = timing_cycles_get(&start_time, &end_time);
-		// total_ns = timing_cycles_to_ns(total_cycles); // not wall time
-		// printk("done with calc, %.3f ms\n", (1.e-6*total_ns)); 
-
-		//   k_sleep(K_MSEC(10000));
-
-		// end_time = timing_counter_get();
-		// total_cycles = timing_cycles_get(&start_time, &end_time);
-		// total_ns = timing_cycles_to_ns(total_cycles);
-		// printk("Analysis time %.3f s\n", 1.e-9f*total_ns);
-
-
-
+		compensate_update(&spectrum); // next waveform table, from this block's harmonics
+#if SAMPLE_TIMER
+		sampler_track(&spectrum); // rate for the next block
+#endif
+		LOG_INF("DC %.2f Tone: %.2f Hz mag %.2f Vrms phase %.3f rad THD %.2f%% rms noise %.2f V/rtHz %.2f C SNR %.1f dB SINAD %.1f dB", 
+			sysdata[0], sysdata[1], sysdata[2], sysdata[3], sysdata[4], sysdata[5], sysdata[6],
+			spectrum.snr, spectrum.sinad);
+		perf_end(&perf_calc, calc_start);
 }
 
 void adc_mainloop() {
+   int64_t start_us = k_ticks_to_us_floor64(k_uptime_ticks());
    adc_measure();
+   uint64_t t = perf_begin();
+   fault_record_block(&raw_data[0], SCAN_CHANNELS, vdd_raw_avg(), start_us, adc_sample_rate());
+   perf_end(&perf_fault, t);
    adc_calc();
 }
 
@@ -269,6 +388,10 @@ static float64_t die_temperature(const struct device *dev)
 	int rc;
 	float64_t die_temp = 0.f;
 
+	if (!dev) {
+		return die_temp;
+	}
+
 	/* fetch sensor samples */
 	rc = sensor_sample_fetch(dev);
 	if (rc) {
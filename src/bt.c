@@ -65,10 +65,126 @@ static const struct bt_data sd[] = {
 // 	BT_DATA(BT_DATA_URI, url_data,sizeof(url_data)),
 // };
 
+#if defined(CONFIG_BT_EXT_ADV)
+/*
+  connectionless telemetry: a second, non-connectable extended advertising set carries a
+  measurement record in its manufacturer data, repeated in periodic advertising if enabled, so
+  one scanning gateway can collect from many inverters without holding connections.
+  record is little endian and versioned; bump the version on any layout change, and update the
+  decoder in scripts/telemetry_scan.py to match
+*/
+#define TELEMETRY_VERSION 1
+typedef struct adv_telemetry_data {
+	uint16_t company_code;	/* Company Identifier Code. */
+	uint8_t version;	/* TELEMETRY_VERSION */
+	uint8_t state;		/* 1 if power output permitted */
+	uint16_t seq;		/* increments every update, wraps */
+	uint32_t freq_mhz;	/* fundamental, millihertz */
+	uint16_t vrms_cv;	/* fundamental magnitude, centivolts rms */
+	uint16_t thd_cpct;	/* THD, hundredths of a percent */
+	int16_t temp_cc;	/* die temperature, hundredths of a degree C */
+} __packed adv_telemetry_data_type;
+BUILD_ASSERT(sizeof(adv_telemetry_data_type) == 16, "layout is decoded by scripts/telemetry_scan.py");
+static adv_telemetry_data_type adv_telemetry_data = {
+	.company_code = sys_cpu_to_le16(COMPANY_ID_CODE),
+	.version = TELEMETRY_VERSION,
+};
+
+static const struct bt_data telemetry_ad[] = {
+	BT_DATA(BT_DATA_MANUFACTURER_DATA, (unsigned char *)&adv_telemetry_data, sizeof(adv_telemetry_data)),
+};
+
+static struct bt_le_ext_adv *telemetry_adv;
+
+static struct bt_le_adv_param *telemetry_adv_param = BT_LE_ADV_PARAM(
+	(BT_LE_ADV_OPT_EXT_ADV |
+	 BT_LE_ADV_OPT_USE_IDENTITY), /* Non-connectable, non-scannable extended advertising, same address as legacy set */
+	1600, /* Min Advertising Interval 1000ms (1600*0.625ms) */
+	1601, /* Max Advertising Interval 1000.625ms (1601*0.625ms) */
+	NULL);
+
+#if defined(CONFIG_BT_PER_ADV)
+static struct bt_le_per_adv_param *telemetry_per_adv_param = BT_LE_PER_ADV_PARAM(
+	800, /* Min Periodic Advertising Interval 1000ms (800*1.25ms) */
+	801, /* Max Periodic Advertising Interval 1001.25ms (801*1.25ms) */
+	BT_LE_PER_ADV_OPT_NONE);
+#endif
+
+static uint16_t clamp_u16(float32_t x) {
+	return (x < 0.f) ? 0U : (x > UINT16_MAX) ? UINT16_MAX : (uint16_t) x;
+}
+
+static void telemetry_update() {
+	adv_telemetry_data.state = permit_service() ? 1U : 0U;
+	adv_telemetry_data.seq = sys_cpu_to_le16(adv_mfg_data.count);
+	adv_telemetry_data.freq_mhz = sys_cpu_to_le32((uint32_t) (sysdata[1]*1000));
+	adv_telemetry_data.vrms_cv = sys_cpu_to_le16(clamp_u16(sysdata[2]*100));
+	adv_telemetry_data.thd_cpct = sys_cpu_to_le16(clamp_u16(sysdata[4]*100));
+	adv_telemetry_data.temp_cc = sys_cpu_to_le16((int16_t) CLAMP(sysdata[6]*100, INT16_MIN, INT16_MAX));
+
+	int err = bt_le_ext_adv_set_data(telemetry_adv, telemetry_ad, ARRAY_SIZE(telemetry_ad), NULL, 0);
+	if (err) {
+		LOG_ERR("Failed to update telemetry advertising data (err %d)", err);
+	}
+#if defined(CONFIG_BT_PER_ADV)
+	err = bt_le_per_adv_set_data(telemetry_adv, telemetry_ad, ARRAY_SIZE(telemetry_ad));
+	if (err) {
+		LOG_ERR("Failed to update periodic advertising data (err %d)", err);
+	}
+#endif
+}
+
+static int telemetry_start() {
+	int err = bt_le_ext_adv_create(telemetry_adv_param, NULL, &telemetry_adv);
+	if (err) {
+		LOG_ERR("Failed to create telemetry advertising set (err %d)", err);
+		return err;
+	}
+	err = bt_le_ext_adv_set_data(telemetry_adv, telemetry_ad, ARRAY_SIZE(telemetry_ad), NULL, 0);
+	if (err) {
+		LOG_ERR("Failed to set telemetry advertising data (err %d)", err);
+		return err;
+	}
+#if defined(CONFIG_BT_PER_ADV)
+	err = bt_le_per_adv_set_param(telemetry_adv, telemetry_per_adv_param);
+	if (err) {
+		LOG_ERR("Failed to set periodic advertising parameters (err %d)", err);
+		return err;
+	}
+	err = bt_le_per_adv_set_data(telemetry_adv, telemetry_ad, ARRAY_SIZE(telemetry_ad));
+	if (err) {
+		LOG_ERR("Failed to set periodic advertising data (err %d)", err);
+		return err;
+	}
+	err = bt_le_per_adv_start(telemetry_adv);
+	if (err) {
+		LOG_ERR("Failed to start periodic advertising (err %d)", err);
+		return err;
+	}
+#endif
+	err = bt_le_ext_adv_start(telemetry_adv, BT_LE_EXT_ADV_START_DEFAULT);
+	if (err) {
+		LOG_ERR("Failed to start telemetry advertising (err %d)", err);
+		return err;
+	}
+	LOG_INF("Telemetry advertising started");
+	return 0;
+}
+#endif /* CONFIG_BT_EXT_ADV */
+
+static struct perf_counter perf_ble_adv = PERF_TIME_INIT("ble_adv"); // advertising data updates, where BLE time goes
+
 void count_handler(struct k_work *work) {
+	uint64_t t = perf_begin();
 	adv_mfg_data.count++;
 	bt_le_adv_update_data(ad, ARRAY_SIZE(ad),
 			      sd, ARRAY_SIZE(sd));
+#if defined(CONFIG_BT_EXT_ADV)
+	if (telemetry_adv) {
+		telemetry_update();
+	}
+#endif
+	perf_end(&perf_ble_adv, t);
 }
 
 struct bt_conn_info info;
@@ -93,7 +209,7 @@ static void connected(struct bt_conn *conn, uint8_t err)
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
-	trip_off();
+	trip_off(TRIP_DISCONNECT);
 	LOG_INF("Disconnected (reason %u)", reason);
 }
 
@@ -110,23 +226,69 @@ BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.le_param_updated = on_le_param_updated,
 };
 
+static struct perf_counter perf_ble_cb = PERF_TIME_INIT("ble_cb"); // GATT callbacks, they only hand off or copy
+
 /* interrupt callback */
 static void statechange_cb(bool newstate)
 {
+	uint64_t t = perf_begin();
     /* Set the state in your work data structure */
     statechange_work_data.newstate = newstate;
 	/* submit work */
     k_work_submit(&statechange_work_data.work);
+	perf_end(&perf_ble_cb, t);
 }
 
 static int32_t readval_cb()
 {
-	return (int32_t) (sysdata[1]*1000); // frequency in millihertz
+	uint64_t t = perf_begin();
+	int32_t val = (int32_t) (sysdata[1]*1000); // frequency in millihertz
+	perf_end(&perf_ble_cb, t);
+	return val;
+}
+
+static size_t readharmonics_cb(void *buf, size_t len)
+{
+	if (len < sizeof(struct mv_harmonics_record_t)) {
+		return 0;
+	}
+	uint64_t t = perf_begin();
+	size_t ret = spectral_record_get(buf);
+	perf_end(&perf_ble_cb, t);
+	return ret;
+}
+
+static size_t readfault_cb(void *buf, size_t len)
+{
+	if (len < sizeof(struct mv_fault_status_t)) {
+		return 0;
+	}
+	uint64_t t = perf_begin();
+	size_t ret = fault_status_get(buf);
+	perf_end(&perf_ble_cb, t);
+	return ret;
+}
+
+static void faultexport_cb()
+{
+	fault_export_request();
+}
+
+static size_t readperf_cb(void *buf, size_t len)
+{
+	if (len < sizeof(struct mv_perf_record_t)) {
+		return 0;
+	}
+	return perf_record_get(buf);
 }
 
 static struct bt_mv_cb bt_mv_callbacks = {
 	.statechange_cb    = statechange_cb,
 	.readval_cb = readval_cb,
+	.readharmonics_cb = readharmonics_cb,
+	.readfault_cb = readfault_cb,
+	.faultexport_cb = faultexport_cb,
+	.readperf_cb = readperf_cb,
 };
 
 K_WORK_DEFINE(count_work, count_handler);
@@ -141,6 +303,8 @@ K_TIMER_DEFINE(count_timer, count_timer_handler, NULL);
 void init_bt() {
 	int err;
 	LOG_INF("Starting Bluetooth");
+	perf_register(&perf_ble_cb);
+	perf_register(&perf_ble_adv);
 
 	err = bt_enable(NULL);
 	if (err) {
@@ -176,6 +340,11 @@ void init_bt() {
 		return;
 	}
 
+#if defined(CONFIG_BT_EXT_ADV)
+	// legacy connectable advertising stays up regardless, so don't fail init over telemetry
+	(void)telemetry_start();
+#endif
+
 	k_timer_start(&count_timer, K_USEC(0U), K_MSEC(1000U));
 	LOG_INF("Advertising successfully started");
 }
\ No newline at end of file
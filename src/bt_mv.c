@@ -20,6 +20,11 @@
 LOG_MODULE_REGISTER(bt_mv, LOG_LEVEL_DBG);
 
 static int32_t system_value;
+static struct mv_harmonics_record_t harmonics_value;
+static size_t harmonics_len;
+static struct mv_fault_status_t fault_value;
+static struct mv_perf_record_t perf_value;
+static size_t perf_len;
 static struct bt_mv_cb bt_mv_cb;
 
 static ssize_t read_state(struct bt_conn *conn,
@@ -41,6 +46,86 @@ static ssize_t read_state(struct bt_conn *conn,
 	return 0;
 }
 
+static ssize_t read_harmonics(struct bt_conn *conn,
+			  const struct bt_gatt_attr *attr,
+			  void *buf,
+			  uint16_t len,
+			  uint16_t offset)
+{
+	LOG_DBG("Attribute read, handle: %u, conn: %p", attr->handle,
+		(void *)conn);
+	if (bt_mv_cb.readharmonics_cb) {
+		// record is longer than one ATT read, so snapshot it at offset 0 and serve the rest of a long read from the copy
+		if (offset == 0U) {
+			harmonics_len = bt_mv_cb.readharmonics_cb(&harmonics_value, sizeof(harmonics_value));
+		}
+		return bt_gatt_attr_read(conn, attr, buf, len, offset, &harmonics_value,
+					 harmonics_len);
+	}
+	return 0;
+}
+
+static ssize_t read_fault(struct bt_conn *conn,
+			  const struct bt_gatt_attr *attr,
+			  void *buf,
+			  uint16_t len,
+			  uint16_t offset)
+{
+	LOG_DBG("Attribute read, handle: %u, conn: %p", attr->handle,
+		(void *)conn);
+	if (bt_mv_cb.readfault_cb) {
+		size_t fault_len = bt_mv_cb.readfault_cb(&fault_value, sizeof(fault_value));
+		return bt_gatt_attr_read(conn, attr, buf, len, offset, &fault_value,
+					 fault_len);
+	}
+	return 0;
+}
+
+static ssize_t read_perf(struct bt_conn *conn,
+			  const struct bt_gatt_attr *attr,
+			  void *buf,
+			  uint16_t len,
+			  uint16_t offset)
+{
+	LOG_DBG("Attribute read, handle: %u, conn: %p", attr->handle,
+		(void *)conn);
+	if (bt_mv_cb.readperf_cb) {
+		// long read, as for harmonics
+		if (offset == 0U) {
+			perf_len = bt_mv_cb.readperf_cb(&perf_value, sizeof(perf_value));
+		}
+		return bt_gatt_attr_read(conn, attr, buf, len, offset, &perf_value,
+					 perf_len);
+	}
+	return 0;
+}
+
+static ssize_t write_fault(struct bt_conn *conn,
+			 const struct bt_gatt_attr *attr,
+			 const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags)
+{
+	LOG_DBG("Attribute write, handle: %u, conn: %p", attr->handle,
+		(void *)conn);
+	if (len != 1U) {
+		LOG_DBG("Write fault: Incorrect data length");
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+	if (offset != 0) {
+		LOG_DBG("Write fault: Incorrect data offset");
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+	uint8_t val = *((uint8_t *)buf);
+	if (val != 0x01) {
+		LOG_DBG("Write fault: Incorrect value");
+		return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+	}
+	if (bt_mv_cb.faultexport_cb) {
+		bt_mv_cb.faultexport_cb();
+	}
+	return len;
+}
+
 static ssize_t write_statechange(struct bt_conn *conn,
 			 const struct bt_gatt_attr *attr,
 			 const void *buf,
@@ -75,6 +160,12 @@ BT_GATT_SERVICE_DEFINE(bt_mv_svc, BT_GATT_PRIMARY_SERVICE(BT_UUID_MV),
 					      BT_GATT_PERM_READ, read_state, NULL, &system_value),
 		       BT_GATT_CHARACTERISTIC(BT_UUID_MV_STATECHANGE, BT_GATT_CHRC_WRITE,
 					      BT_GATT_PERM_WRITE, NULL, write_statechange, NULL),
+		       BT_GATT_CHARACTERISTIC(BT_UUID_MV_HARMONICS, BT_GATT_CHRC_READ,
+					      BT_GATT_PERM_READ, read_harmonics, NULL, NULL),
+		       BT_GATT_CHARACTERISTIC(BT_UUID_MV_FAULT, BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+					      BT_GATT_PERM_READ | BT_GATT_PERM_WRITE, read_fault, write_fault, NULL),
+		       BT_GATT_CHARACTERISTIC(BT_UUID_MV_PERF, BT_GATT_CHRC_READ,
+					      BT_GATT_PERM_READ, read_perf, NULL, NULL),
 
 );
 
@@ -84,6 +175,10 @@ int bt_mv_init(struct bt_mv_cb *callbacks)
 	if (callbacks) {
 		bt_mv_cb.statechange_cb = callbacks->statechange_cb;
 		bt_mv_cb.readval_cb = callbacks->readval_cb;
+		bt_mv_cb.readharmonics_cb = callbacks->readharmonics_cb;
+		bt_mv_cb.readfault_cb = callbacks->readfault_cb;
+		bt_mv_cb.faultexport_cb = callbacks->faultexport_cb;
+		bt_mv_cb.readperf_cb = callbacks->readperf_cb;
 	}
     LOG_DBG("bt_mv_init complete");
 
@@ -22,9 +22,21 @@ extern "C" {
 // statechange characteristic
 #define BT_UUID_MV_STATECHANGE_VAL \
 	BT_UUID_128_ENCODE(0x00011526, 0x1212, 0xefde, 0x1523, 0x785feabcd124)
+// harmonics telemetry record characteristic
+#define BT_UUID_MV_HARMONICS_VAL \
+	BT_UUID_128_ENCODE(0x00011527, 0x1212, 0xefde, 0x1523, 0x785feabcd124)
+// fault recorder characteristic: read status, write 0x01 to export the recording over the console
+#define BT_UUID_MV_FAULT_VAL \
+	BT_UUID_128_ENCODE(0x00011528, 0x1212, 0xefde, 0x1523, 0x785feabcd124)
+// performance counters record characteristic
+#define BT_UUID_MV_PERF_VAL \
+	BT_UUID_128_ENCODE(0x00011529, 0x1212, 0xefde, 0x1523, 0x785feabcd124)
 #define BT_UUID_MV           BT_UUID_DECLARE_128(BT_UUID_MV_VAL)
 #define BT_UUID_MV_READVAL    BT_UUID_DECLARE_128(BT_UUID_MV_READVAL_VAL)
 #define BT_UUID_MV_STATECHANGE       BT_UUID_DECLARE_128(BT_UUID_MV_STATECHANGE_VAL)
+#define BT_UUID_MV_HARMONICS    BT_UUID_DECLARE_128(BT_UUID_MV_HARMONICS_VAL)
+#define BT_UUID_MV_FAULT    BT_UUID_DECLARE_128(BT_UUID_MV_FAULT_VAL)
+#define BT_UUID_MV_PERF    BT_UUID_DECLARE_128(BT_UUID_MV_PERF_VAL)
 
 /** @brief Callback type for when a state change is received. */
 typedef void (*statechange_cb_t)(const bool newstate);
@@ -32,9 +44,19 @@ typedef void (*statechange_cb_t)(const bool newstate);
 /** @brief Callback type for when the button state is pulled. */
 typedef int32_t (*readval_cb_t)(void);
 
+/** @brief Callback type for when a telemetry record is pulled, fills buf and returns its length. */
+typedef size_t (*readrecord_cb_t)(void *buf, size_t len);
+
+/** @brief Callback type for when a fault recording export is requested. */
+typedef void (*faultexport_cb_t)(void);
+
 struct bt_mv_cb {
 	statechange_cb_t statechange_cb;
 	readval_cb_t readval_cb;
+	readrecord_cb_t readharmonics_cb;
+	readrecord_cb_t readfault_cb;
+	faultexport_cb_t faultexport_cb;
+	readrecord_cb_t readperf_cb;
 };
 
 int bt_mv_init(struct bt_mv_cb *callbacks);
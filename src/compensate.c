@@ -0,0 +1,143 @@
+/*
+	harmonic pre-compensation of the waveform table
+
+	iterative learning on the measured spectrum: each good block, the output harmonics relative
+	to the fundamental are turned into a correction in duty units and accumulated with gain
+	COMP_GAIN, so dead time and switch distortion are cancelled by shaping levels[] against them.
+	harmonic phases are taken at the block centre and referred to the fundamental, so they
+	don't depend on when the block started or on any pure delay in the plant or decimator.
+	that reference assumes a non-inverting sense path, otherwise set SENSE_INVERTED, or even
+	harmonics would be corrected with the wrong sign and grow.
+	needs the fundamental COMP_MIN_BIN bins up or more, so it is idle at the 3 Hz bench setting.
+
+	the corrected table is built in the spare of two buffers and published by swapping a
+	pointer, which step_handler() picks up at the start of the next waveform cycle. a buffer is
+	only rewritten once step_handler() has let go of it, so the timer never has to stop
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <math.h>
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(compensate, CONFIG_ADC_LOG_LEVEL);
+
+#include "mv.h"
+
+#define TWO_PI 6.28318530718f
+#define COMP_MIN_SNR 20.f // dB, blocks noisier than this don't update the correction
+#define COMP_MIN_BIN 11 // below this, flat-top main lobes of neighbouring harmonics overlap
+// keep both switch pulses in the PWM period after DEADTIME_NS is added and taken off
+#define DUTY_MIN (DEADTIME_NS*PWM_FREQ*1.e-9f)
+#define DUTY_MAX (1.f - DUTY_MIN)
+
+BUILD_ASSERT(COMP_HARMONICS <= HARMONICS_MAX, "can only correct harmonics spectral analysis measures");
+
+static const float *base; // uncompensated levels[]
+static float tables[2][STEPS];
+static atomic_ptr_t active; // published table
+static atomic_ptr_t in_use; // table step_handler() is running from
+static float32_t cos_tab[STEPS], sin_tab[STEPS]; // one cycle, harmonic k reads every k-th entry
+
+static float32_t base_amplitude; // fundamental of base, duty
+static float32_t base_phase; // fundamental of base as a cosine, rad
+static float32_t corr_re[COMP_HARMONICS+1], corr_im[COMP_HARMONICS+1]; // by harmonic, duty
+
+static struct perf_counter perf_compensate = PERF_TIME_INIT("compensate");
+
+void compensate_init(const float *levels) {
+	base = levels;
+	float32_t re = 0.f, im = 0.f;
+	for (size_t i = 0; i < STEPS; i++) {
+		cos_tab[i] = cosf(TWO_PI*i/STEPS);
+		sin_tab[i] = sinf(TWO_PI*i/STEPS);
+		re += base[i]*cos_tab[i];
+		im -= base[i]*sin_tab[i];
+	}
+	base_amplitude = 2.f*sqrtf(re*re + im*im)/STEPS;
+	base_phase = atan2f(im, re);
+	memset(corr_re, 0, sizeof(corr_re));
+	memset(corr_im, 0, sizeof(corr_im));
+
+	memcpy(tables[0], base, sizeof(tables[0]));
+	memcpy(tables[1], base, sizeof(tables[1]));
+	atomic_ptr_set(&active, tables[0]);
+	atomic_ptr_set(&in_use, tables[0]);
+	perf_register(&perf_compensate);
+	if (COMP_HARMONICS >= 2 && WAVEFORM_FREQ < COMP_MIN_BIN*adc_sample_rate()/BLOCK_SIZE) {
+		LOG_WRN("Waveform at %d Hz is below bin %d, harmonic compensation stays idle",
+			WAVEFORM_FREQ, COMP_MIN_BIN);
+	}
+}
+
+/* called by step_handler() at the start of each waveform cycle */
+const float *compensate_table() {
+	const float *t = atomic_ptr_get(&active);
+	atomic_ptr_set(&in_use, (atomic_ptr_val_t) t);
+	return t;
+}
+
+/* phase of a spectrum line at the centre of the (decimated) block rather than its start */
+static float32_t centre_phase(float32_t phase, uint32_t bin) {
+	return phase + PI*bin*(FFT_SIZE - 1)/FFT_SIZE;
+}
+
+static void publish() {
+	float *next = (atomic_ptr_get(&active) == tables[0]) ? tables[1] : tables[0];
+	for (size_t i = 0; i < STEPS; i++) {
+		float32_t level = base[i];
+		for (size_t k = 2; k <= COMP_HARMONICS; k++) {
+			size_t n = (k*i) % STEPS;
+			level += corr_re[k]*cos_tab[n] - corr_im[k]*sin_tab[n];
+		}
+		next[i] = CLAMP(level, DUTY_MIN, DUTY_MAX);
+	}
+	atomic_ptr_set(&active, next);
+}
+
+/* one learning step from the spectrum of a block taken with the output running */
+void compensate_update(const struct mv_spectrum_t *spectrum) {
+	// snr is NAN when not measurable, which fails the test too
+	if (COMP_HARMONICS < 2 || !permit_service() || spectrum->harmonics < 2U ||
+		spectrum->fundamental_bin < COMP_MIN_BIN || !(spectrum->snr >= COMP_MIN_SNR) ||
+		!(spectrum->magnitude[0] > 0.f)) {
+		return;
+	}
+	float32_t bin_width = spectrum->fundamental_hz/spectrum->fundamental_bin;
+	if (fabsf(spectrum->fundamental_hz_fine - WAVEFORM_FREQ) > bin_width) {
+		return; // not our waveform, e.g. tripped into a grid
+	}
+	if (atomic_ptr_get(&in_use) != atomic_ptr_get(&active)) {
+		return; // last table not picked up yet, its spare is still being run from
+	}
+	uint64_t t = perf_begin();
+
+	// spectral_calc() reads harmonic k from the bin nearest k*f0, so it is within half a bin of
+	// its line and the centre phase holds
+	float32_t phase1 = centre_phase(spectrum->phase[0], spectrum->bin[0]);
+	float32_t scale = COMP_GAIN*base_amplitude/spectrum->magnitude[0];
+	size_t harmonics = MIN(spectrum->harmonics, COMP_HARMONICS);
+	for (size_t k = 2; k <= harmonics; k++) {
+		// harmonic relative to the fundamental, then into table phase, and subtract
+		float32_t rel = centre_phase(spectrum->phase[k-1], spectrum->bin[k-1]) - k*phase1;
+		if (SENSE_INVERTED) {
+			rel += PI*(k - 1); // inverting every line flips the even harmonics against the fundamental
+		}
+		float32_t step = scale*spectrum->magnitude[k-1];
+		corr_re[k] -= step*cosf(rel + k*base_phase);
+		corr_im[k] -= step*sinf(rel + k*base_phase);
+		float32_t mag = sqrtf(corr_re[k]*corr_re[k] + corr_im[k]*corr_im[k]);
+		if (mag > COMP_LIMIT) {
+			corr_re[k] *= COMP_LIMIT/mag;
+			corr_im[k] *= COMP_LIMIT/mag;
+		}
+	}
+	publish();
+	perf_end(&perf_compensate, t);
+}
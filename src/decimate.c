@@ -0,0 +1,126 @@
+/*
+	multirate decimation of one ADC block ahead of spectral analysis
+
+	CIC_STAGES-stage CIC decimating by CIC_DECIMATION on the integer mV samples (wraparound
+	arithmetic, no multiplies), then a polyphase FIR (arm_fir_decimate_f32) decimating by
+	FIR_DECIMATION that also flattens the CIC passband droop. the result is FFT_SIZE samples at
+	1/DECIMATION of the sample rate, so the FFT keeps the bin width of a BLOCK_SIZE transform.
+	either stage is bypassed when its factor is 1
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <math.h>
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(decimate, CONFIG_ADC_LOG_LEVEL);
+
+#include "mv.h"
+
+#define CIC_OUT_SIZE (BLOCK_SIZE/CIC_DECIMATION)
+#define DESIGN_POINTS 256 // integration points for the FIR frequency sampling design
+#define FIR_CUTOFF (FIR_EDGE_PERMIL*1.e-3f/FIR_DECIMATION) // cycles/sample at CIC output rate, below final nyquist
+
+BUILD_ASSERT(BLOCK_SIZE % DECIMATION == 0, "block must decimate to a whole number of samples");
+BUILD_ASSERT(FIR_PASSBAND_PERMIL < FIR_EDGE_PERMIL && FIR_EDGE_PERMIL < 1000 - FIR_PASSBAND_PERMIL,
+	"FIR edge must clear the analysed band and what folds back onto it");
+
+static float32_t cic_out[CIC_OUT_SIZE];
+static float32_t fir_coeffs[FIR_TAPS];
+static float32_t fir_state[FIR_TAPS + CIC_OUT_SIZE - 1];
+static arm_fir_decimate_instance_f32 fir_S;
+
+/* CIC magnitude response, f in cycles/sample at the CIC output rate */
+static float64_t cic_response(float64_t f) {
+	if (f == 0.) {
+		return 1.;
+	}
+	float64_t h = sin(PI*f)/(CIC_DECIMATION*sin(PI*f/CIC_DECIMATION));
+	return pow(fabs(h), CIC_STAGES);
+}
+
+/*
+  lowpass with passband 1/cic_response up to FIR_CUTOFF, by frequency sampling (numerical
+  inverse transform of the desired response) and a Blackman window. runs once at init
+*/
+static void design_fir() {
+	float64_t center = (FIR_TAPS - 1)/2.;
+	float64_t df = FIR_CUTOFF/DESIGN_POINTS;
+	float64_t sum = 0.;
+	for (size_t n = 0; n < FIR_TAPS; n++) {
+		float64_t acc = 0.;
+		for (size_t p = 0; p < DESIGN_POINTS; p++) {
+			float64_t f = (p + 0.5)*df;
+			acc += cos(2.*PI*f*(n - center))/cic_response(f);
+		}
+		float64_t w = 0.42 - 0.5*cos(2.*PI*n/(FIR_TAPS - 1)) + 0.08*cos(4.*PI*n/(FIR_TAPS - 1));
+		float64_t h = 2.*acc*df*w;
+		fir_coeffs[n] = h;
+		sum += h;
+	}
+	// unity DC gain, coefficients are symmetric so CMSIS time-reversed order is the same
+	for (size_t n = 0; n < FIR_TAPS; n++) {
+		fir_coeffs[n] /= sum;
+	}
+}
+
+void decimate_init() {
+	if (FIR_DECIMATION > 1) {
+		design_fir();
+		arm_status status = arm_fir_decimate_init_f32(&fir_S, FIR_TAPS, FIR_DECIMATION,
+			fir_coeffs, fir_state, CIC_OUT_SIZE);
+		if (status != ARM_MATH_SUCCESS) {
+			LOG_ERR("arm_fir_decimate_init failure");
+			// XXX fail better
+		}
+	}
+	LOG_INF("Decimation %d (CIC %d x FIR %d), %d point FFT",
+		DECIMATION, CIC_DECIMATION, FIR_DECIMATION, FFT_SIZE);
+}
+
+/*
+  decimate BLOCK_SIZE samples in mV to FFT_SIZE samples, scaled by scale (V per mV).
+  blocks are not contiguous in time, so filter state is reset each block and the first sample is
+  taken out ahead of the filters and added back after, to avoid a start-up step
+*/
+void decimate_block(const int32_t *in, float32_t *out, float32_t scale) {
+	int32_t x0 = in[0];
+	float32_t *stage_out = (FIR_DECIMATION > 1) ? cic_out : out;
+
+	if (CIC_DECIMATION > 1) {
+		uint32_t integ[CIC_STAGES] = {0}, comb[CIC_STAGES] = {0};
+		float32_t cic_scale = scale/powf(CIC_DECIMATION, CIC_STAGES);
+		size_t phase = 0, j = 0;
+		for (size_t i = 0; i < BLOCK_SIZE; i++) {
+			integ[0] += (uint32_t) (in[i] - x0);
+			for (size_t k = 1; k < CIC_STAGES; k++) {
+				integ[k] += integ[k-1];
+			}
+			if (++phase == CIC_DECIMATION) {
+				phase = 0;
+				uint32_t y = integ[CIC_STAGES-1];
+				for (size_t k = 0; k < CIC_STAGES; k++) {
+					uint32_t t = y;
+					y -= comb[k];
+					comb[k] = t;
+				}
+				stage_out[j++] = cic_scale*(int32_t) y;
+			}
+		}
+	} else {
+		for (size_t i = 0; i < BLOCK_SIZE; i++) {
+			stage_out[i] = scale*(in[i] - x0);
+		}
+	}
+
+	if (FIR_DECIMATION > 1) {
+		memset(fir_state, 0, sizeof(fir_state));
+		arm_fir_decimate_f32(&fir_S, cic_out, out, CIC_OUT_SIZE);
+	}
+	arm_offset_f32(out, scale*x0, out, FFT_SIZE);
+}
@@ -0,0 +1,223 @@
+/*
+	fault waveform recorder
+
+	keeps the last FAULT_PRE_BLOCKS + FAULT_POST_BLOCKS ADC blocks in a ring, signal channel
+	packed two 12-bit samples to three bytes, supply channel as a per-block average. on a trip the
+	ring keeps filling until FAULT_POST_BLOCKS blocks started after the trip, then freezes until
+	exported. the block being acquired at the trip is kept on top of FAULT_PRE_BLOCKS.
+	export is COMTRADE (IEEE C37.111-1999) style, ASCII cfg then dat, over the console
+*/
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+LOG_MODULE_REGISTER(fault, CONFIG_ADC_LOG_LEVEL);
+
+#include "mv.h"
+
+#define FAULT_SLOTS (FAULT_PRE_BLOCKS + 1 + FAULT_POST_BLOCKS) // plus the block in flight at the trip
+#define PACKED_SIZE (BLOCK_SIZE*3/2)
+#define RAW_MAX 4095U // 12 bit
+#define EXPORT_LINES_PER_DRAIN 8 // ~50 bytes each, well inside CONFIG_LOG_BUFFER_SIZE
+#if defined(CONFIG_BT_DEVICE_NAME)
+#define REC_DEV_ID CONFIG_BT_DEVICE_NAME
+#else
+#define REC_DEV_ID "mv"
+#endif
+
+BUILD_ASSERT(BLOCK_SIZE % 2 == 0, "samples are packed in pairs");
+
+enum fault_state {
+	FAULT_ARMED = 0,
+	FAULT_POST,
+	FAULT_FROZEN,
+	FAULT_EXPORTING,
+};
+
+struct fault_block {
+	int64_t start_us; // uptime at start of acquisition
+	float32_t sample_us; // sample period, the timer clock may retune between blocks
+	uint16_t vdd_avg; // raw counts
+	uint8_t packed[PACKED_SIZE];
+};
+
+static struct fault_block ring[FAULT_SLOTS];
+static size_t head; // next slot to write
+static size_t filled;
+static size_t post_recorded; // blocks recorded that started after the trigger, acquisition thread only
+
+static atomic_t state = ATOMIC_INIT(FAULT_ARMED);
+static atomic_t export_requested;
+static enum trip_reason trigger_reason;
+static int64_t trigger_us; // 0 until a trip has set it
+
+static float32_t signal_scale, vdd_scale; // mV per raw count
+
+void fault_init(float32_t signal_mv_per_count, float32_t vdd_mv_per_count) {
+	signal_scale = signal_mv_per_count;
+	vdd_scale = vdd_mv_per_count;
+}
+
+static inline uint16_t clamp_raw(uint16_t x) {
+	// SAADC can return small negative values near ground, stored as large unsigned
+	return (x > RAW_MAX) ? ((x & 0x8000U) ? 0U : RAW_MAX) : x;
+}
+
+/* called by acquisition after each block, cost is one pass packing the block (fault_record perf counter) */
+void fault_record_block(const uint16_t *signal, size_t stride, uint16_t vdd, int64_t start_us,
+	float32_t sample_rate) {
+	atomic_val_t s = atomic_get(&state);
+	if (s != FAULT_ARMED && s != FAULT_POST) {
+		return;
+	}
+
+	struct fault_block *blk = &ring[head];
+	uint8_t *p = blk->packed;
+	for (size_t i = 0; i < BLOCK_SIZE; i += 2) {
+		uint16_t a = clamp_raw(signal[i*stride]);
+		uint16_t b = clamp_raw(signal[(i+1)*stride]);
+		*p++ = a & 0xffU;
+		*p++ = (a >> 8) | ((b & 0x0fU) << 4);
+		*p++ = b >> 4;
+	}
+	blk->vdd_avg = clamp_raw(vdd);
+	blk->start_us = start_us;
+	blk->sample_us = 1.e6f/sample_rate;
+	head = (head + 1) % FAULT_SLOTS;
+	filled = MIN(filled + 1, FAULT_SLOTS);
+
+	// a block already under way at the trip is mostly pre-trigger data, don't count it
+	int64_t trip_us = trigger_us;
+	if (s == FAULT_POST && trip_us > 0 && start_us >= trip_us &&
+		++post_recorded == FAULT_POST_BLOCKS) {
+		atomic_set(&state, FAULT_FROZEN);
+		LOG_WRN("Fault recording complete, reason %d", trigger_reason);
+	}
+}
+
+/* safe from any thread; only the first trip after arming is recorded */
+void fault_trigger(enum trip_reason reason) {
+	if (reason == TRIP_INIT) {
+		return;
+	}
+	if (!atomic_cas(&state, FAULT_ARMED, FAULT_POST)) {
+		return;
+	}
+	trigger_reason = reason;
+	trigger_us = k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+void fault_export_request() {
+	atomic_set(&export_requested, 1);
+}
+
+size_t fault_status_get(struct mv_fault_status_t *status) {
+	status->state = (uint8_t) atomic_get(&state);
+	status->reason = (uint8_t) trigger_reason;
+	status->pre_blocks = FAULT_PRE_BLOCKS;
+	status->post_blocks = FAULT_POST_BLOCKS;
+	status->trigger_us = trigger_us;
+	return sizeof(*status);
+}
+
+static uint16_t unpack(const uint8_t *packed, size_t i) {
+	const uint8_t *p = &packed[(i/2)*3];
+	if (i % 2 == 0) {
+		return p[0] | ((p[1] & 0x0fU) << 8);
+	}
+	return (p[1] >> 4) | (p[2] << 4);
+}
+
+/*
+  with CONFIG_LOG_PRINTK, printk is queued in the log buffer and dropped when that overflows.
+  wait for it to empty every few lines, so the export can't outrun the console; if other
+  messages still crowd it out, the log core reports "messages dropped" in the output
+*/
+static void export_drain() {
+#if defined(CONFIG_LOG_MODE_DEFERRED)
+	while (log_data_pending()) {
+		k_msleep(1);
+	}
+#else
+	k_yield();
+#endif
+}
+
+/* COMTRADE date/time field from uptime, epoch 01/01/1970 since there is no RTC */
+static void print_timestamp(int64_t us) {
+	uint64_t s = us/1000000;
+	// civil date from days since the epoch, proleptic Gregorian, March-based year
+	uint32_t z = s/86400 + 719468U;
+	uint32_t era = z/146097U;
+	uint32_t doe = z - era*146097U;
+	uint32_t yoe = (doe - doe/1460U + doe/36524U - doe/146096U)/365U;
+	uint32_t doy = doe - (365U*yoe + yoe/4U - yoe/100U);
+	uint32_t mp = (5U*doy + 2U)/153U;
+	uint32_t day = doy - (153U*mp + 2U)/5U + 1U;
+	uint32_t month = (mp < 10U) ? mp + 3U : mp - 9U;
+	uint32_t year = yoe + era*400U + ((month <= 2U) ? 1U : 0U);
+	printk("%02u/%02u/%04u,%02u:%02u:%02u.%06u\n", (unsigned int) day, (unsigned int) month,
+		(unsigned int) year, (unsigned int) (s/3600 % 24), (unsigned int) (s/60 % 60),
+		(unsigned int) (s % 60), (unsigned int) (us % 1000000));
+}
+
+static void export_comtrade() {
+	size_t oldest = (filled == FAULT_SLOTS) ? head : 0U;
+	int64_t first_us = ring[oldest].start_us;
+
+	export_drain();
+	printk("--- COMTRADE cfg, trip reason %d ---\n", trigger_reason);
+	printk("mv,%s,1999\n", REC_DEV_ID);
+	printk("2,2A,0D\n");
+	printk("1,VIN,,,mV,%.6f,0,0,0,%u,1,1,P\n", (double) signal_scale, RAW_MAX);
+	printk("2,VDD,,,mV,%.6f,0,0,0,%u,1,1,P\n", (double) vdd_scale, RAW_MAX);
+	printk("%d\n", WAVEFORM_FREQ);
+	printk("0\n"); // blocks are not contiguous, so sample times come from the dat timestamps
+	printk("0,%u\n", (unsigned int) (filled*BLOCK_SIZE));
+	print_timestamp(first_us);
+	print_timestamp(trigger_us);
+	printk("ASCII\n");
+	printk("1\n");
+
+	export_drain();
+	printk("--- COMTRADE dat ---\n");
+	uint32_t n = 1U;
+	for (size_t b = 0; b < filled; b++) {
+		const struct fault_block *blk = &ring[(oldest + b) % FAULT_SLOTS];
+		for (size_t i = 0; i < BLOCK_SIZE; i++) {
+			uint32_t t = (uint32_t) (blk->start_us - first_us + (int64_t) (i*blk->sample_us));
+			printk("%u,%u,%u,%u\n", (unsigned int) n++, (unsigned int) t,
+				(unsigned int) unpack(blk->packed, i), (unsigned int) blk->vdd_avg);
+			if (n % EXPORT_LINES_PER_DRAIN == 0U) {
+				export_drain();
+			}
+		}
+	}
+	printk("--- COMTRADE end ---\n");
+}
+
+/* called from the main loop: runs a requested export, then re-arms */
+void fault_service() {
+	if (!atomic_cas(&export_requested, 1, 0)) {
+		return;
+	}
+	if (!atomic_cas(&state, FAULT_FROZEN, FAULT_EXPORTING)) {
+		LOG_INF("No fault recording to export");
+		return;
+	}
+	export_comtrade();
+	head = filled = post_recorded = 0U;
+	trigger_us = 0;
+	atomic_set(&state, FAULT_ARMED);
+	LOG_INF("Fault recording exported, recorder re-armed");
+}
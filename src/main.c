@@ -49,17 +49,31 @@ struct mv_nameplate_t mv_nameplate = {
 
 float32_t sysdata[7] = {0.f};
 
+bool permit_service() {
+	return mv_param.PermitService;
+}
+
+// time from step timer to step_handler running, i.e. how long the system workqueue held it
+static struct perf_counter perf_step_latency = PERF_TIME_INIT("step_latency");
+static struct perf_counter perf_step_overrun = PERF_GAUGE_INIT("step_overrun"); // count = steps still queued at next tick
+static uint64_t step_submitted;
+
 void step_handler(struct k_work *work)
 {
 	static uint32_t count = 0;
 	static uint32_t oldpulsewidth_ns = 0;
+	static const float *table = levels;
 
+	perf_end(&perf_step_latency, step_submitted);
 	if (!mv_param.PermitService) {
 		LOG_INF("step_handler called when not powered"); // this is normal: we may have steps left in the workqueue even if the output has been turned off
 																// catching and ignoring them in the handler is recc https://docs.zephyrproject.org/latest/kernel/services/threads/workqueue.html#workqueue-best-practices
 		return;
 	}
-	uint32_t pulsewidth_ns = PWM_HZ(PWM_FREQ)*levels[count++ % STEPS]; 
+	if (count % STEPS == 0) {
+		table = compensate_table(); // pick up a new correction only between waveform cycles
+	}
+	uint32_t pulsewidth_ns = PWM_HZ(PWM_FREQ)*table[count++ % STEPS]; 
 	uint32_t ret = pwm_set_dt(&custompwm0, 
 		PWM_HZ(PWM_FREQ), 
 		pulsewidth_ns);
@@ -82,11 +96,11 @@ void step_handler(struct k_work *work)
 	if (ret) {
 		LOG_ERR("Error %d: failed to set pulse width", ret);
 		// XXX
-		trip_off(); // shouldn't happen, but if it does, trip?
+		trip_off(TRIP_PWM_ERROR); // shouldn't happen, but if it does, trip?
 	}
 	if (!mv_param.PermitService) {
 		LOG_ERR("ERR: step_handler finished when not powered"); // should not happen
-		trip_off(); // but if it does let's power off
+		trip_off(TRIP_STATE_ERROR); // but if it does let's power off
 	}
 }
 
@@ -94,7 +108,10 @@ K_WORK_DEFINE(step_work, step_handler);
 
 void step_timer_handler(struct k_timer *dummy)
 {
-    k_work_submit(&step_work);
+    step_submitted = perf_begin();
+    if (k_work_submit(&step_work) == 0) {
+        perf_inc(&perf_step_overrun);
+    }
 }
 
 void step_timer_off()
@@ -115,7 +132,11 @@ struct statechange_work_data statechange_work_data = {
 /*
   turn everything off and set to known state
 */
-void trip_off() {
+void trip_off(enum trip_reason reason) {
+	/* freeze waveform recording if this is tripping a running output */
+	if (mv_param.PermitService) {
+		fault_trigger(reason);
+	}
 	/* set state */
 	mv_param.PermitService = false;
 	/* stop any running timers */
@@ -146,7 +167,7 @@ void statechange_handler(struct k_work* work) {
 		mv_param.PermitService = true;
 		LOG_INF("Power state turned on");
 	} else {
-		trip_off();
+		trip_off(TRIP_STATECHANGE);
 		LOG_INF("Power state turned off");
 	}	
 }
@@ -156,7 +177,7 @@ void pwm_init() {
 		LOG_ERR("Error: PWM device %s is not ready",
 		       custompwm0.dev->name);
 	} 
-	trip_off();
+	trip_off(TRIP_INIT);
 	LOG_INF("pwm_init complete");
 }
 
@@ -164,9 +185,11 @@ void waveform_init() {
 	for (int i =0; i < STEPS; i++) {
 		levels[i] = mv_param.duty_avg*(1 + mv_param.duty_range*sin(TWO_PI*i/STEPS));
 	}
+	compensate_init(levels);
 }
 
 void console_init() {
+#if defined(CONFIG_USB_DEVICE_STACK)
 	const struct device *const dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_console));
 	uint32_t dtr = 0;
 
@@ -181,12 +204,16 @@ void console_init() {
 		uart_line_ctrl_get(dev, UART_LINE_CTRL_DTR, &dtr);
 		k_sleep(K_MSEC(100));
 	}
+#endif
 
 	LOG_INF("Console_init complete");
 
 }
 
 int init_hw_id() {
+#if !defined(CONFIG_HW_ID_LIBRARY)
+	return 0;
+#else
 	int err = hw_id_get(mv_nameplate.HardwareID, ARRAY_SIZE(mv_nameplate.HardwareID));
 	if (err) {
 		LOG_ERR("hw_id_get failed (err %d)\n", err);
@@ -194,19 +221,31 @@ int init_hw_id() {
 	}
 	LOG_INF("hw_id: %s\n", mv_nameplate.HardwareID);
 	return 0;
+#endif
 }
 
 int main(void)
 {
+	perf_init();
+	perf_register(&perf_step_latency);
+	perf_register(&perf_step_overrun);
 	console_init();
 	pwm_init();
 	waveform_init();
+#if defined(CONFIG_BT)
 	init_bt();
+#endif
 	adc_init();
 	init_hw_id();
+#if defined(CONFIG_ADC_EMUL)
+	// no BLE central to command it in the plant simulator, so turn the output on at boot
+	statechange_work_data.newstate = true;
+	k_work_submit(&statechange_work_data.work);
+#endif
 
 	while (1) {
 		adc_mainloop();
+		fault_service();
 		k_sleep(K_MSEC(1));
 	}
 	k_sleep(K_FOREVER);
@@ -3,13 +3,22 @@
 #ifndef BT_H_
 #define BT_H_
 #include <arm_math_types.h>
+#if defined(CONFIG_HW_ID_LIBRARY)
 #include <hw_id.h>
+#else
+#define HW_ID_LEN 17 // room for "unsupported" when built without the hw_id library, e.g. native_sim
+#endif
+#include <zephyr/toolchain.h>
 
 /* interfaces */
 
 void init_bt();
 void adc_init();
 void adc_mainloop();
+float32_t adc_sample_rate();
+void spectral_init(float32_t window_sum, float32_t window_sumsq);
+void decimate_init();
+void decimate_block(const int32_t *in, float32_t *out, float32_t scale);
 
 extern float32_t sysdata[];
 
@@ -21,7 +30,17 @@ struct statechange_work_data {
 
 extern struct statechange_work_data statechange_work_data;
 
-extern void trip_off();
+// why the output was tripped, recorded with fault waveforms
+enum trip_reason {
+    TRIP_INIT = 0, // set to known state at startup, not a fault
+    TRIP_STATECHANGE, // commanded off
+    TRIP_DISCONNECT, // BLE central disconnected
+    TRIP_PWM_ERROR, // pulse width could not be set
+    TRIP_STATE_ERROR, // step ran while output not permitted
+};
+
+extern void trip_off(enum trip_reason reason);
+bool permit_service();
 
 /*
  * system configuration
@@ -31,10 +50,71 @@ extern void trip_off();
 #define WAVEFORM_FREQ 3 // Hz
 
 #define STEPS 180
-extern float levels[]; // holds duty cycles, duty = what fraction of time HS switch is on
+extern float levels[]; // holds duty cycles, duty = what fraction of time HS switch is on. uncompensated, see compensate.c
 #define DUTY_AVG 0.5f // 0. to 1.
 #define DUTY_RANGE 0.90f // 0. to 1.
 #define DEADTIME_NS 500U
+// highest harmonic pre-compensated in levels[] from measured spectra, 0 to disable. needs the
+// fundamental at bin 11 or above, ~42 Hz at the default rate and block, so idle at WAVEFORM_FREQ 3
+#define COMP_HARMONICS 13
+#define COMP_GAIN 0.2f // learning rate, fraction of the measured error corrected per block
+#define COMP_LIMIT 0.05f // largest correction of any one harmonic, duty
+
+#define VDD_INTERLEAVED 0 // VDD converted alongside every signal sample, subtracted sample by sample
+#define VDD_BLOCK 1 // VDD averaged over a short separate sequence each block, signal gets the whole buffer
+#define VDD_SAMPLING VDD_INTERLEAVED
+#define VDD_SAMPLES 16 // VDD_BLOCK: conversions averaged per block
+#if VDD_SAMPLING == VDD_BLOCK
+#define SCAN_CHANNELS 1
+#else
+#define SCAN_CHANNELS 2
+#endif
+#define RAW_SIZE 8192 // ADC buffer, conversions of all scanned channels per block
+#define BLOCK_SIZE (RAW_SIZE/SCAN_CHANNELS) // signal samples per block
+#if VDD_SAMPLING == VDD_BLOCK
+// estimate only, the free-running single channel rate is measured each block: channel 0 takes
+// 40 us acquisition + 2 us conversion, plus the driver overhead seen in the interleaved rate
+#define SAMPLE_RATE 17000.f
+#else
+#define SAMPLE_RATE 15640.4f // constant is sampling rate, determined by experimental calibration
+#endif
+#define SAMPLE_CLOCK_FREE 0 // SAADC free-runs through extra samplings at SAMPLE_RATE
+#define SAMPLE_CLOCK_TIMER 1 // TIMER + PPI trigger at exactly SAMPLE_RATE_TIMER (to a 16 MHz tick)
+#define SAMPLE_CLOCK_COHERENT 2 // TIMER + PPI, rate retuned so blocks hold whole fundamental cycles
+#define SAMPLE_CLOCK SAMPLE_CLOCK_FREE
+#if VDD_SAMPLING == VDD_BLOCK
+#define SAMPLE_RATE_TIMER 20000.f // Hz, nominal rate for the timer clocked modes, under 1/(40+2 us)
+#else
+#define SAMPLE_RATE_TIMER 16000.f // Hz, nominal rate for the timer clocked modes, under 1/(40+3+2*2 us)
+#endif
+#if SAMPLE_CLOCK != SAMPLE_CLOCK_FREE && defined(CONFIG_ADC_NRFX_SAADC)
+#define SAMPLE_TIMER 1
+#else
+#define SAMPLE_TIMER 0 // e.g. native_sim, where the plant paces the ADC emulator at SAMPLE_RATE
+#endif
+#define VOLTAGE_DIVIDER_SF 0.241f // scale factor 241 is 2*820k/6.8k, *1e-3 (mV to V)
+#define SENSE_INVERTED 0 // 1 if the sensed voltage falls as HS duty rises, divider and plant.c don't invert
+#define CIC_DECIMATION 2 // 1 to bypass
+#define CIC_STAGES 3
+#define FIR_DECIMATION 2 // 1 to bypass
+#define FIR_TAPS 64
+#define DECIMATION (CIC_DECIMATION*FIR_DECIMATION)
+#define FFT_SIZE (BLOCK_SIZE/DECIMATION) // same bin width as the undecimated block, power of 2 from 32 to 4096
+#define FIR_PASSBAND_PERMIL 400 // analysed band in thousandths of the decimated rate, nyquist is 500
+#define FIR_EDGE_PERMIL 460 // FIR design cutoff (-6 dB), past the analysed band so it is flat up to there
+#if FIR_DECIMATION > 1
+#define SPECTRAL_BINS (FFT_SIZE*FIR_PASSBAND_PERMIL/1000) // bins analysed, the decimator attenuates above
+#else
+#define SPECTRAL_BINS (FFT_SIZE/2)
+#endif
+// the analysed band ends at FIR_PASSBAND_PERMIL/1000*rate/DECIMATION, ~1.56 kHz at SAMPLE_RATE with 2x2
+// decimation, within 0.15 dB of flat and with -80 dB or less folding back into it. all HARMONICS_MAX
+// harmonics are only measured for a fundamental up to ~31 Hz; above that
+// the harmonic count in the spectrum results drops
+#define HARMONICS_MAX 50 // fundamental plus harmonics tracked by spectral analysis
+#define LOBE_BINS 4 // flat-top main lobe half-width; the fine fundamental needs the peak above it
+#define FAULT_PRE_BLOCKS 3 // ADC blocks kept from before a trip
+#define FAULT_POST_BLOCKS 1 // ADC blocks recorded after a trip
 
 //////
 
@@ -50,4 +130,113 @@ struct mv_nameplate_t {
 
 };
 
+// result of spectral analysis on one block. index 0 of the harmonic arrays is the fundamental,
+// index k-1 is harmonic k
+struct mv_spectrum_t {
+    uint32_t fundamental_bin;
+    float32_t fundamental_hz;
+    float32_t fundamental_hz_fine; // interpolated between bins, power centroid of the main lobe; fundamental_hz up to bin LOBE_BINS
+    uint32_t harmonics; // number of valid entries below, fundamental included
+    uint32_t bin[HARMONICS_MAX]; // spectrum bin each harmonic was read from
+    float32_t magnitude[HARMONICS_MAX]; // Vrms
+    float32_t phase[HARMONICS_MAX]; // rad
+    float32_t thd; // percent
+    float32_t snr; // dB, NAN when the spectrum leaves no bins to estimate noise from
+    float32_t sinad; // dB, NAN as snr
+    float32_t noise_density; // V/rtHz, NAN as snr
+};
+
+int spectral_calc(const float32_t *fftout, const float32_t *ps, uint32_t fundamental_bin,
+    float32_t bin_width, struct mv_spectrum_t *out);
+
+// telemetry record for export over BLE, little endian, versioned so readers can reject layouts they don't know
+#define MV_HARMONICS_RECORD_VERSION 1
+struct mv_harmonics_record_t {
+    uint8_t version;
+    uint8_t harmonics;
+    uint16_t reserved;
+    float32_t fundamental_hz;
+    float32_t thd;
+    float32_t snr;
+    float32_t sinad;
+    float32_t magnitude[HARMONICS_MAX];
+    float32_t phase[HARMONICS_MAX];
+    float32_t fundamental_hz_fine; // interpolated between bins, appended so version 1 readers still parse
+} __packed;
+
+size_t spectral_record_get(struct mv_harmonics_record_t *rec);
+
+/* harmonic pre-compensation of the waveform table */
+void compensate_init(const float *levels);
+const float *compensate_table();
+void compensate_update(const struct mv_spectrum_t *spectrum);
+
+/* hardware sample clock, nRF only (SAMPLE_TIMER) */
+struct adc_dt_spec;
+int sampler_init(const struct adc_dt_spec *channels, size_t n);
+int sampler_read(uint16_t *buf, size_t scans);
+float32_t sampler_rate();
+bool sampler_coherent();
+void sampler_track(const struct mv_spectrum_t *spectrum);
+
+/* fault waveform recorder */
+void fault_init(float32_t signal_mv_per_count, float32_t vdd_mv_per_count);
+void fault_record_block(const uint16_t *signal, size_t stride, uint16_t vdd, int64_t start_us,
+    float32_t sample_rate);
+void fault_trigger(enum trip_reason reason);
+void fault_export_request();
+void fault_service();
+
+// fault recorder status, readable over BLE
+struct mv_fault_status_t {
+    uint8_t state; // 0 armed, 1 recording post-trigger, 2 frozen, 3 exporting
+    uint8_t reason; // enum trip_reason
+    uint8_t pre_blocks;
+    uint8_t post_blocks;
+    int64_t trigger_us; // uptime at trip
+} __packed;
+
+size_t fault_status_get(struct mv_fault_status_t *status);
+
+/* performance counters */
+#define PERF_MAX_COUNTERS 16
+
+struct perf_counter {
+    const char *name;
+    bool is_time; // values in cpu cycles, reported in us
+    uint32_t count;
+    uint32_t last;
+    uint32_t max;
+    uint64_t total;
+};
+
+#define PERF_TIME_INIT(_name) { .name = _name, .is_time = true }
+#define PERF_GAUGE_INIT(_name) { .name = _name, .is_time = false }
+
+void perf_init();
+int perf_register(struct perf_counter *c);
+uint64_t perf_begin();
+void perf_end(struct perf_counter *c, uint64_t start);
+void perf_set(struct perf_counter *c, uint32_t value);
+void perf_inc(struct perf_counter *c);
+void perf_reset();
+
+// all counters in registration order (names from the "perf show" shell command)
+#define MV_PERF_RECORD_VERSION 1
+struct mv_perf_entry_t {
+    uint32_t count;
+    uint32_t last;
+    uint32_t max;
+    uint32_t avg;
+} __packed;
+
+struct mv_perf_record_t {
+    uint8_t version;
+    uint8_t counters;
+    uint16_t reserved;
+    struct mv_perf_entry_t entry[PERF_MAX_COUNTERS];
+} __packed;
+
+size_t perf_record_get(struct mv_perf_record_t *rec);
+
 #endif /* BT_H_ */
@@ -0,0 +1,158 @@
+/*
+	runtime performance counters
+
+	modules register named counters once at init, then update them from their hot paths with
+	perf_begin()/perf_end() (cpu cycles, reported in us), perf_set() (a value, e.g. a rate) or
+	perf_inc() (an event). all counters can be dumped with the "perf" shell command or read as one
+	record over BLE
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/timing/timing.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(perf, LOG_LEVEL_INF);
+
+#include "mv.h"
+
+static struct perf_counter *counters[PERF_MAX_COUNTERS];
+static size_t n_counters;
+
+static k_tid_t main_thread;
+static struct perf_counter stack_main = PERF_GAUGE_INIT("stack_main_free");
+static struct perf_counter stack_sysworkq = PERF_GAUGE_INIT("stack_sysworkq_free");
+
+void perf_init() {
+#if defined(CONFIG_TIMING_FUNCTIONS)
+	timing_init();
+	timing_start();
+#endif
+	main_thread = k_current_get();
+	perf_register(&stack_main);
+	perf_register(&stack_sysworkq);
+}
+
+int perf_register(struct perf_counter *c) {
+	if (n_counters >= PERF_MAX_COUNTERS) {
+		LOG_ERR("No room to register counter %s", c->name);
+		return -ENOMEM;
+	}
+	counters[n_counters++] = c;
+	return 0;
+}
+
+uint64_t perf_begin() {
+#if defined(CONFIG_TIMING_FUNCTIONS)
+	return timing_counter_get();
+#else
+	return k_cycle_get_32();
+#endif
+}
+
+void perf_end(struct perf_counter *c, uint64_t start) {
+#if defined(CONFIG_TIMING_FUNCTIONS)
+	timing_t begin = start, end = timing_counter_get();
+	perf_set(c, (uint32_t) timing_cycles_get(&begin, &end));
+#else
+	perf_set(c, k_cycle_get_32() - (uint32_t) start);
+#endif
+}
+
+void perf_set(struct perf_counter *c, uint32_t value) {
+	c->count++;
+	c->last = value;
+	c->total += value;
+	if (value > c->max) {
+		c->max = value;
+	}
+}
+
+void perf_inc(struct perf_counter *c) {
+	c->count++;
+}
+
+static uint32_t cycles_to_us(uint64_t cycles) {
+#if defined(CONFIG_TIMING_FUNCTIONS)
+	return (uint32_t) (timing_cycles_to_ns(cycles)/1000U);
+#else
+	return (uint32_t) k_cyc_to_us_floor64(cycles);
+#endif
+}
+
+/* stack watermarks are sampled when read rather than on a hot path */
+static void sample_stacks() {
+#if defined(CONFIG_THREAD_STACK_INFO)
+	size_t unused;
+	if (main_thread && k_thread_stack_space_get(main_thread, &unused) == 0) {
+		perf_set(&stack_main, unused);
+	}
+	if (k_thread_stack_space_get(&k_sys_work_q.thread, &unused) == 0) {
+		perf_set(&stack_sysworkq, unused);
+	}
+#endif
+}
+
+static void entry_get(const struct perf_counter *c, struct mv_perf_entry_t *e) {
+	uint32_t avg = (c->count > 0U) ? (uint32_t) (c->total/c->count) : 0U;
+	e->count = c->count;
+	e->last = c->is_time ? cycles_to_us(c->last) : c->last;
+	e->max = c->is_time ? cycles_to_us(c->max) : c->max;
+	e->avg = c->is_time ? cycles_to_us(avg) : avg;
+}
+
+/* all counters in registration order, time counters in us; returns size in bytes */
+size_t perf_record_get(struct mv_perf_record_t *rec) {
+	sample_stacks();
+	memset(rec, 0, sizeof(*rec));
+	rec->version = MV_PERF_RECORD_VERSION;
+	rec->counters = (uint8_t) n_counters;
+	for (size_t i = 0; i < n_counters; i++) {
+		entry_get(counters[i], &rec->entry[i]);
+	}
+	return offsetof(struct mv_perf_record_t, entry) + n_counters*sizeof(rec->entry[0]);
+}
+
+void perf_reset() {
+	for (size_t i = 0; i < n_counters; i++) {
+		struct perf_counter *c = counters[i];
+		c->count = c->last = c->max = 0U;
+		c->total = 0U;
+	}
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_perf_show(const struct shell *sh, size_t argc, char **argv) {
+	sample_stacks();
+	shell_print(sh, "%-22s %10s %10s %10s %10s", "counter", "count", "last", "max", "avg");
+	for (size_t i = 0; i < n_counters; i++) {
+		struct mv_perf_entry_t e;
+		entry_get(counters[i], &e);
+		shell_print(sh, "%-22s %10u %10u %10u %10u%s", counters[i]->name,
+			(unsigned int) e.count, (unsigned int) e.last, (unsigned int) e.max, (unsigned int) e.avg,
+			counters[i]->is_time ? " us" : "");
+	}
+	return 0;
+}
+
+static int cmd_perf_reset(const struct shell *sh, size_t argc, char **argv) {
+	perf_reset();
+	shell_print(sh, "counters reset");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_perf,
+	SHELL_CMD(show, NULL, "Show performance counters", cmd_perf_show),
+	SHELL_CMD(reset, NULL, "Reset performance counters", cmd_perf_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(perf, &sub_perf, "Performance counters", NULL);
+#endif
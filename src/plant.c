@@ -0,0 +1,159 @@
+/*
+	software-in-the-loop plant model for native_sim
+
+	a PWM driver (compatible "mv,plant-pwm") takes the switch commands from step_handler(),
+	including the DEADTIME_NS gap between HS and LS, and drives an averaged half-bridge
+	between +-PLANT_VDC/2, an LC filter and a resistive load or a grid behind a resistance.
+	the ADC emulator samples the filter capacitor through the same divider as the hardware,
+	paced to SAMPLE_RATE in simulated time.
+
+	build: west build -b native_sim -- -DCONF_FILE=prj_sim.conf
+	with CONFIG_NATIVE_SIM_SLOWDOWN_TO_REAL_TIME=n (default in prj_sim.conf) it runs as fast as
+	the host allows
+*/
+
+#define DT_DRV_COMPAT mv_plant_pwm
+
+#include <stdint.h>
+
+#include <math.h>
+#include "arm_math.h"
+
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/drivers/adc/adc_emul.h>
+#include <zephyr/drivers/pwm.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(plant, LOG_LEVEL_INF);
+
+#include "mv.h"
+
+#define PLANT_VDC 48.f // V, DC bus
+#define PLANT_L 1.e-3f // H, filter inductor
+#define PLANT_R_L 0.1f // ohm, inductor and switch resistance
+#define PLANT_C 10.e-6f // F, filter capacitor
+#define PLANT_GRID 0 // 1: load is a grid source behind PLANT_R_LOAD, 0: resistive load only
+#define PLANT_R_LOAD 100.f // ohm, load, or grid impedance if PLANT_GRID
+#define PLANT_GRID_VRMS 15.f // V
+#define PLANT_GRID_FREQ WAVEFORM_FREQ // Hz
+#define PLANT_VDD_MV 3000 // supply rail seen on the VDD channel
+#define PLANT_SUBSTEPS 16 // integration steps per ADC sample
+
+#define PWM_CHANNELS 3
+#define PWM_HS 2 // channel numbers as wired in the overlay and step_handler()
+#define PWM_LS 1
+#define CYCLES_PER_SEC 1000000000ULL // 1 ns resolution, so pulse widths come through exactly
+
+#define TWO_PI 6.28318530718f
+
+static const struct device *const plant_adc = DEVICE_DT_GET(DT_IO_CHANNELS_CTLR_BY_IDX(DT_PATH(zephyr_user), 0));
+#define SIGNAL_CHANNEL DT_IO_CHANNELS_INPUT_BY_IDX(DT_PATH(zephyr_user), 0)
+#define VDD_CHANNEL DT_IO_CHANNELS_INPUT_BY_IDX(DT_PATH(zephyr_user), 1)
+
+struct plant_state {
+	uint32_t on_ns[PWM_CHANNELS]; // time each switch is on per PWM period
+	uint32_t period_ns;
+	float32_t i_l; // A, inductor current, positive out of the bridge
+	float32_t v_c; // V, capacitor = sensed output voltage
+	float32_t grid_phase; // rad, wrapped to [0, 2pi) so it keeps full resolution on long runs
+	float32_t wait_us; // fraction of a microsecond carried between samples
+};
+
+static struct plant_state plant;
+
+/* averaged bridge voltage over one PWM period, dead time resolved by the freewheeling diode */
+static float32_t bridge_voltage(float32_t d_hs, float32_t d_dead) {
+	float32_t d_high = d_hs + ((plant.i_l < 0.f) ? d_dead : 0.f);
+	return PLANT_VDC*(d_high - 0.5f);
+}
+
+static void plant_step(float32_t dt) {
+	float32_t period = (plant.period_ns > 0U) ? plant.period_ns : 1.f;
+	float32_t d_hs = plant.on_ns[PWM_HS]/period;
+	float32_t d_ls = plant.on_ns[PWM_LS]/period;
+	float32_t d_dead = CLAMP(1.f - d_hs - d_ls, 0.f, 1.f);
+	float32_t v_src = PLANT_GRID ? PLANT_GRID_VRMS*sqrtf(2.f)*sinf(plant.grid_phase) : 0.f;
+
+	for (int n = 0; n < PLANT_SUBSTEPS; n++) {
+		if (d_dead >= 1.f) {
+			plant.i_l = 0.f; // both switches off, inductor current has nowhere to go
+		} else {
+			float32_t v_l = bridge_voltage(d_hs, d_dead) - plant.v_c - PLANT_R_L*plant.i_l;
+			plant.i_l += dt*v_l/PLANT_L;
+		}
+		float32_t i_load = (plant.v_c - v_src)/PLANT_R_LOAD;
+		plant.v_c += dt*(plant.i_l - i_load)/PLANT_C; // semi-implicit Euler, uses the updated current
+	}
+	plant.grid_phase += TWO_PI*PLANT_GRID_FREQ*dt*PLANT_SUBSTEPS;
+	if (plant.grid_phase >= TWO_PI) {
+		plant.grid_phase -= TWO_PI;
+	}
+}
+
+/* ADC emulator callback, result in mV at the ADC pin */
+static int plant_adc_value(const struct device *dev, unsigned int chan, void *data, uint32_t *result) {
+	if (chan == VDD_CHANNEL) {
+		*result = PLANT_VDD_MV;
+		return 0;
+	}
+
+	plant_step(1.f/(SAMPLE_RATE*PLANT_SUBSTEPS));
+	float32_t mv = plant.v_c/VOLTAGE_DIVIDER_SF + PLANT_VDD_MV/2;
+	*result = (uint32_t) CLAMP(mv, 0.f, 3600.f);
+
+	// advance simulated time by one sample period so PWM steps land at the right point in the waveform
+	plant.wait_us += 1.e6f/SAMPLE_RATE;
+	uint32_t wait = (uint32_t) plant.wait_us;
+	plant.wait_us -= wait;
+	k_busy_wait(wait);
+	return 0;
+}
+
+static int plant_pwm_set_cycles(const struct device *dev, uint32_t channel,
+	uint32_t period_cycles, uint32_t pulse_cycles, pwm_flags_t flags) {
+	if (channel >= PWM_CHANNELS || pulse_cycles > period_cycles) {
+		return -EINVAL;
+	}
+	plant.period_ns = period_cycles;
+	plant.on_ns[channel] = (flags & PWM_POLARITY_INVERTED) ? period_cycles - pulse_cycles : pulse_cycles;
+	return 0;
+}
+
+static int plant_pwm_get_cycles_per_sec(const struct device *dev, uint32_t channel, uint64_t *cycles) {
+	*cycles = CYCLES_PER_SEC;
+	return 0;
+}
+
+static const struct pwm_driver_api plant_pwm_api = {
+	.set_cycles = plant_pwm_set_cycles,
+	.get_cycles_per_sec = plant_pwm_get_cycles_per_sec,
+};
+
+static int plant_pwm_init(const struct device *dev) {
+	return 0;
+}
+
+DEVICE_DT_INST_DEFINE(0, plant_pwm_init, NULL, NULL, NULL,
+	POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE, &plant_pwm_api);
+
+/* after drivers are up, hook the plant into the ADC emulator */
+static int plant_init(void) {
+	if (!device_is_ready(plant_adc)) {
+		LOG_ERR("ADC emulator %s not ready", plant_adc->name);
+		return -ENODEV;
+	}
+	int err = adc_emul_value_func_set(plant_adc, SIGNAL_CHANNEL, plant_adc_value, NULL);
+	err |= adc_emul_value_func_set(plant_adc, VDD_CHANNEL, plant_adc_value, NULL);
+	if (err) {
+		LOG_ERR("Could not attach plant to ADC emulator (%d)", err);
+		return err;
+	}
+	LOG_INF("Plant model attached: Vdc %.1f V, L %.2g H, C %.2g F, %s %.1f ohm",
+		(double) PLANT_VDC, (double) PLANT_L, (double) PLANT_C, PLANT_GRID ? "grid via" : "load", (double) PLANT_R_LOAD);
+	return 0;
+}
+
+SYS_INIT(plant_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,177 @@
+/*
+	hardware sample clock for the nRF SAADC
+
+	TIMER2 compare -> PPI -> SAADC SAMPLE, so every scan of the configured channels starts on an
+	exact 16 MHz tick instead of whenever the driver ISR gets round to it. SAADC END -> PPI ->
+	TIMER2 STOP ends the block after exactly the requested number of scans. channels are set up
+	by the Zephyr ADC driver as usual; this only runs the acquisition, with the driver's END
+	interrupt masked so it doesn't see a sequence it didn't start.
+
+	SAMPLE_CLOCK_TIMER runs at SAMPLE_RATE_TIMER. SAMPLE_CLOCK_COHERENT retunes the rate after
+	each block so the block holds a whole number of fundamental cycles
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/sys/util.h>
+#include <hal/nrf_saadc.h>
+#include <hal/nrf_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sampler, CONFIG_ADC_LOG_LEVEL);
+
+#include "mv.h"
+
+#define SAMPLE_TIMER_REG NRF_TIMER2 // TIMER0/1 belong to the BLE controller
+#define TIMER_HZ 16000000U // prescaler 0
+#define SAMPLE_RATE_MIN (SAMPLE_RATE_TIMER/2)
+#define SAADC_CONV_US 2.f // conversion time, upper bound from the nRF52840 product specification
+#define SAADC_DEFAULT_ACQ_US 10.f // ADC_ACQ_TIME_DEFAULT on the SAADC
+
+static uint32_t period_ticks = (uint32_t) (TIMER_HZ/SAMPLE_RATE_TIMER + 0.5f);
+static bool locked;
+static uint8_t ppi_sample, ppi_stop;
+static uint32_t channel_mask;
+static float32_t rate_max; // Hz, a scan must finish before the next trigger
+static nrf_saadc_input_t channel_inputs[SAADC_CH_NUM];
+
+/* acquisition time of a channel as configured in devicetree, us */
+static float32_t acquisition_us(uint16_t acq) {
+	if (acq == ADC_ACQ_TIME_DEFAULT) {
+		return SAADC_DEFAULT_ACQ_US;
+	}
+	switch (ADC_ACQ_TIME_UNIT(acq)) {
+	case ADC_ACQ_TIME_MICROSECONDS:
+		return ADC_ACQ_TIME_VALUE(acq);
+	case ADC_ACQ_TIME_NANOSECONDS:
+		return ADC_ACQ_TIME_VALUE(acq)/1000.f;
+	default:
+		return SAADC_DEFAULT_ACQ_US;
+	}
+}
+
+int sampler_init(const struct adc_dt_spec *channels, size_t n) {
+	float32_t scan_us = 0.f;
+	for (size_t i = 0; i < n; i++) {
+		channel_mask |= BIT(channels[i].channel_id);
+		// devicetree NRF_SAADC_AINx/VDD values are the PSELP register values
+		channel_inputs[channels[i].channel_id] = (nrf_saadc_input_t) channels[i].channel_cfg.input_positive;
+		scan_us += acquisition_us(channels[i].channel_cfg.acquisition_time) + SAADC_CONV_US;
+	}
+	rate_max = 1.e6f/scan_us;
+	if (sampler_rate() > rate_max) {
+		LOG_WRN("Sample rate %.0f Hz above %.0f Hz the scan allows, limited", (double) sampler_rate(),
+			(double) rate_max);
+		period_ticks = (uint32_t) ceilf(TIMER_HZ/rate_max);
+	}
+
+	if (nrfx_gppi_channel_alloc(&ppi_sample) != NRFX_SUCCESS ||
+	    nrfx_gppi_channel_alloc(&ppi_stop) != NRFX_SUCCESS) {
+		LOG_ERR("No PPI channels for sample clock");
+		return -ENODEV;
+	}
+	nrfx_gppi_channel_endpoints_setup(ppi_sample,
+		nrf_timer_event_address_get(SAMPLE_TIMER_REG, NRF_TIMER_EVENT_COMPARE0),
+		nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_SAMPLE));
+	nrfx_gppi_channel_endpoints_setup(ppi_stop,
+		nrf_saadc_event_address_get(NRF_SAADC, NRF_SAADC_EVENT_END),
+		nrf_timer_task_address_get(SAMPLE_TIMER_REG, NRF_TIMER_TASK_STOP));
+
+	nrf_timer_mode_set(SAMPLE_TIMER_REG, NRF_TIMER_MODE_TIMER);
+	nrf_timer_bit_width_set(SAMPLE_TIMER_REG, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_prescaler_set(SAMPLE_TIMER_REG, 0);
+	nrf_timer_shorts_enable(SAMPLE_TIMER_REG, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK);
+
+	LOG_INF("Sample clock %.3f Hz (%u ticks)%s", (double) sampler_rate(), (unsigned int) period_ticks,
+		(SAMPLE_CLOCK == SAMPLE_CLOCK_COHERENT) ? ", coherent" : "");
+	return 0;
+}
+
+float32_t sampler_rate() {
+	return (float32_t) TIMER_HZ/period_ticks;
+}
+
+bool sampler_coherent() {
+	return (SAMPLE_CLOCK == SAMPLE_CLOCK_COHERENT) && locked;
+}
+
+/* fill buf with scans interleaved by channel number, blocking until done */
+int sampler_read(uint16_t *buf, size_t scans) {
+	size_t nchannels = POPCOUNT(channel_mask);
+	bool was_enabled = nrf_saadc_enable_check(NRF_SAADC);
+
+	nrf_saadc_enable(NRF_SAADC);
+	nrf_saadc_int_disable(NRF_SAADC, NRF_SAADC_INT_END);
+	nrf_saadc_resolution_set(NRF_SAADC, NRF_SAADC_RESOLUTION_12BIT);
+	nrf_saadc_oversample_set(NRF_SAADC, NRF_SAADC_OVERSAMPLE_DISABLED);
+	for (uint8_t ch = 0; ch < SAADC_CH_NUM; ch++) {
+		nrf_saadc_channel_pos_input_set(NRF_SAADC, ch,
+			(channel_mask & BIT(ch)) ? channel_inputs[ch] : NRF_SAADC_INPUT_DISABLED);
+	}
+	nrf_saadc_buffer_init(NRF_SAADC, (nrf_saadc_value_t *) buf, scans*nchannels);
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_STARTED);
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_END);
+	nrf_saadc_task_trigger(NRF_SAADC, NRF_SAADC_TASK_START);
+	while (!nrf_saadc_event_check(NRF_SAADC, NRF_SAADC_EVENT_STARTED)) {
+	}
+
+	nrf_timer_cc_set(SAMPLE_TIMER_REG, NRF_TIMER_CC_CHANNEL0, period_ticks);
+	nrf_timer_task_trigger(SAMPLE_TIMER_REG, NRF_TIMER_TASK_CLEAR);
+	nrfx_gppi_channels_enable(BIT(ppi_sample) | BIT(ppi_stop));
+	nrf_timer_task_trigger(SAMPLE_TIMER_REG, NRF_TIMER_TASK_START);
+
+	// sleep through most of the block, then poll for the end
+	uint32_t block_us = (uint32_t) (1.e6f*scans/sampler_rate());
+	k_sleep(K_USEC(block_us));
+	int64_t deadline = k_uptime_get() + block_us/1000U + 100;
+	int err = 0;
+	while (!nrf_saadc_event_check(NRF_SAADC, NRF_SAADC_EVENT_END)) {
+		if (k_uptime_get() > deadline) {
+			LOG_ERR("Sample clock block did not complete");
+			err = -ETIMEDOUT;
+			break;
+		}
+		k_usleep(100);
+	}
+
+	nrfx_gppi_channels_disable(BIT(ppi_sample) | BIT(ppi_stop));
+	nrf_timer_task_trigger(SAMPLE_TIMER_REG, NRF_TIMER_TASK_STOP);
+	nrf_saadc_task_trigger(NRF_SAADC, NRF_SAADC_TASK_STOP);
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_END);
+	nrf_saadc_int_enable(NRF_SAADC, NRF_SAADC_INT_END);
+	if (!was_enabled) {
+		nrf_saadc_disable(NRF_SAADC);
+	}
+	return err;
+}
+
+/*
+  coherent mode: pick the rate nearest SAMPLE_RATE_TIMER at which the block spans a whole
+  number of cycles of f0. needs an f0 estimate finer than a bin, or it would just lock onto
+  the bin it started in, so it holds the rate and stays unlocked with the fundamental at or
+  below LOBE_BINS, where spectral_calc() only has the peak bin
+*/
+void sampler_track(const struct mv_spectrum_t *spectrum) {
+	if (SAMPLE_CLOCK != SAMPLE_CLOCK_COHERENT) {
+		return;
+	}
+	float32_t f0 = spectrum->fundamental_hz_fine;
+	if (spectrum->fundamental_bin <= LOBE_BINS || !(f0 > 0.f)) {
+		locked = false;
+		return;
+	}
+	float32_t cycles = roundf(BLOCK_SIZE*f0/SAMPLE_RATE_TIMER);
+	if (cycles < 1.f) {
+		cycles = 1.f;
+	}
+	float32_t rate = CLAMP(BLOCK_SIZE*f0/cycles, SAMPLE_RATE_MIN, rate_max);
+	uint32_t ticks = MAX((uint32_t) (TIMER_HZ/rate + 0.5f), (uint32_t) ceilf(TIMER_HZ/rate_max));
+	locked = (ticks == period_ticks); // settled to the nearest tick
+	period_ticks = ticks;
+}
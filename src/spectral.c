@@ -0,0 +1,166 @@
+/*
+	spectral metrics on the power spectrum of one (decimated) ADC block
+
+	bins are classified into a noise mask (tone, harmonics and a couple of bins either side
+	excluded), rebuilt only when the fundamental moves, so the per-block work is a
+	single dot product over the spectrum plus a gather of at most HARMONICS_MAX bins. only the
+	SPECTRAL_BINS inside the decimator passband are used, the transition band would read low
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <math.h>
+#include "arm_math.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(spectral, CONFIG_ADC_LOG_LEVEL);
+
+#include "mv.h"
+
+#define SQR(x) ((x)*(x))
+
+#define GUARD_BINS 5 // bins either side of tone and harmonics kept out of the noise estimate, past the flat-top main lobe
+
+static float32_t noise_mask[SPECTRAL_BINS]; // 1.f for noise bins, 0.f otherwise
+static uint32_t noise_bins;
+static float32_t mask_spacing; // harmonic spacing in bins the mask was built for, 0 = not built
+
+static float32_t window_sum, window_sumsq; // window normalizations, from adc
+
+static struct mv_harmonics_record_t record; // last published result
+static struct k_spinlock record_lock;
+
+void spectral_init(float32_t sum, float32_t sumsq) {
+	window_sum = sum;
+	window_sumsq = sumsq;
+	mask_spacing = 0.f;
+}
+
+/* bin of harmonic k (1 = fundamental), nearest to k times the spacing */
+static inline uint32_t harmonic_bin(uint32_t k, float32_t spacing) {
+	return (uint32_t) (k*spacing + 0.5f);
+}
+
+static void build_noise_mask(float32_t spacing) {
+	arm_fill_f32(1.f, noise_mask, SPECTRAL_BINS);
+	// walk the harmonics, DC included, instead of a test per bin
+	for (uint32_t k = 0, m = 0; m < SPECTRAL_BINS + GUARD_BINS; m = harmonic_bin(++k, spacing)) {
+		uint32_t lo = (m > GUARD_BINS) ? m - GUARD_BINS : 0U;
+		uint32_t hi = MIN(m + GUARD_BINS + 1U, SPECTRAL_BINS);
+		for (uint32_t i = lo; i < hi; i++) {
+			noise_mask[i] = 0.f;
+		}
+	}
+	float32_t bins;
+	arm_dot_prod_f32(noise_mask, noise_mask, SPECTRAL_BINS, &bins);
+	noise_bins = (uint32_t) bins;
+	mask_spacing = spacing;
+}
+
+/*
+  fundamental between bins, power centroid of the main lobe. harmonics are read at multiples of
+  it, so a fundamental off the centre of its bin doesn't push the higher harmonics out of theirs.
+  with the lobe cut off by DC (low fundamental_bin) the centroid is biased, e.g. 1.5 for a tone
+  at bin 1, so stay on the peak bin there and don't report anything finer
+*/
+static float32_t harmonic_spacing(const float32_t *ps, uint32_t fundamental_bin) {
+	if (fundamental_bin <= LOBE_BINS) {
+		return fundamental_bin;
+	}
+	float32_t lobe = 0.f, moment = 0.f;
+	for (uint32_t i = fundamental_bin - LOBE_BINS;
+		 i <= fundamental_bin + LOBE_BINS && i < SPECTRAL_BINS; i++) {
+		lobe += ps[i];
+		moment += ps[i]*i;
+	}
+	return (lobe > 0.f) ? moment/lobe : fundamental_bin;
+}
+
+int spectral_calc(const float32_t *fftout, const float32_t *ps, uint32_t fundamental_bin,
+	float32_t bin_width, struct mv_spectrum_t *out) {
+	memset(out, 0, sizeof(*out));
+	if (fundamental_bin == 0U || fundamental_bin >= SPECTRAL_BINS) {
+		return -EINVAL;
+	}
+	float32_t spacing = harmonic_spacing(ps, fundamental_bin);
+	// rebuild once the top harmonic has moved half a bin; within that the guard bins cover it
+	if (mask_spacing == 0.f || fabsf(spacing - mask_spacing)*SPECTRAL_BINS > 0.5f*spacing) {
+		build_noise_mask(spacing);
+	}
+
+	// no noise estimate when tone and harmonics leave no clean bins, i.e. fundamental_bin <= 2*GUARD_BINS
+	float32_t noisePerBin = 0.f;
+	if (noise_bins > 0U) {
+		float32_t noisePower;
+		arm_dot_prod_f32(ps, noise_mask, SPECTRAL_BINS, &noisePower);
+		noisePerBin = noisePower/noise_bins;
+	}
+
+	// per-harmonic magnitude and phase, harmonic k from the bin nearest k*spacing
+	float32_t ampScale = 2.f/SQR(window_sum);
+	float32_t tonePower = ps[fundamental_bin];
+	float32_t harmonicPower = 0.f;
+	uint32_t h = 0U;
+	for (uint32_t bin = fundamental_bin; h < HARMONICS_MAX && bin < SPECTRAL_BINS;
+		 bin = harmonic_bin(h + 1U, spacing)) {
+		float32_t p = ps[bin];
+		if (h > 0U) {
+			harmonicPower += p;
+		}
+		out->bin[h] = bin;
+		out->magnitude[h] = sqrtf(ampScale*p);
+		out->phase[h] = atan2f(fftout[2*bin+1], fftout[2*bin]);
+		h++;
+	}
+	harmonicPower -= (h-1)*noisePerBin; // subtract white noise background from harmonic distortion measurement
+	if (harmonicPower < 0.f) {
+		harmonicPower = 0.f; // if harmonic distortion outweighed by noise, display 0.
+	}
+
+	// powers in V^2: tone and harmonics via amplitude scaling, noise via the window's sum of squares
+	// (white noise of variance s^2 gives s^2*window_sumsq in every bin)
+	float32_t toneV2 = ampScale*tonePower;
+	float32_t harmonicV2 = ampScale*harmonicPower;
+	float32_t noiseV2 = noisePerBin/window_sumsq;
+
+	out->fundamental_bin = fundamental_bin;
+	out->fundamental_hz = bin_width*fundamental_bin;
+	out->fundamental_hz_fine = bin_width*spacing;
+	out->harmonics = h;
+	out->thd = (tonePower > 0.f) ? 100.f*sqrtf(harmonicPower/tonePower) : 0.f;
+	if (noise_bins > 0U) {
+		out->snr = (noiseV2 > 0.f) ? 10.f*log10f(toneV2/noiseV2) : 0.f;
+		out->sinad = (noiseV2 + harmonicV2 > 0.f) ? 10.f*log10f(toneV2/(noiseV2 + harmonicV2)) : 0.f;
+		// one sided, over the decimated band of FFT_SIZE*bin_width Hz
+		out->noise_density = sqrtf(2.f*noisePerBin/(FFT_SIZE*bin_width*window_sumsq));
+	} else {
+		out->snr = out->sinad = out->noise_density = NAN; // not measured
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&record_lock);
+	record.version = MV_HARMONICS_RECORD_VERSION;
+	record.harmonics = (uint8_t) h;
+	record.fundamental_hz = out->fundamental_hz;
+	record.fundamental_hz_fine = out->fundamental_hz_fine;
+	record.thd = out->thd;
+	record.snr = out->snr;
+	record.sinad = out->sinad;
+	memcpy(record.magnitude, out->magnitude, sizeof(record.magnitude));
+	memcpy(record.phase, out->phase, sizeof(record.phase));
+	k_spin_unlock(&record_lock, key);
+
+	return 0;
+}
+
+/* copy of the last published record, returns its size in bytes */
+size_t spectral_record_get(struct mv_harmonics_record_t *rec) {
+	k_spinlock_key_t key = k_spin_lock(&record_lock);
+	memcpy(rec, &record, sizeof(*rec));
+	k_spin_unlock(&record_lock, key);
+	return sizeof(*rec);
+}